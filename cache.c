@@ -0,0 +1,413 @@
+#define _DEFAULT_SOURCE
+#include "cache.h"
+#include "gtools.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC "FWGCACHE"
+#define CACHE_VERSION 2
+
+//Writes a new header and (sparse) empty slots, with fd locked
+static bool init_table(int fd, uint64_t num_slots, uint64_t num_used)
+{
+	cache_header header;
+	memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+	header.version = CACHE_VERSION;
+	header.wordsize = WORDSIZE;
+	header.sparse_canon_min_n = SPARSE_CANON_MIN_N;
+	header.unused = 0;
+	header.num_slots = num_slots;
+	header.num_used = num_used;
+	return ftruncate(fd, sizeof(cache_header) +
+					 num_slots * sizeof(cache_slot)) == 0 &&
+		   pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+}
+
+//Opens and maps the table at c->path, creating it if it doesn't
+//exist yet
+static bool map_table(metrics_cache *c)
+{
+	int fd = open(c->path, O_RDWR | O_CREAT, 0666);
+	if(fd < 0)
+	{
+		perror(c->path);
+		return false;
+	}
+
+	//only one process gets to create the table
+	flock(fd, LOCK_EX);
+	struct stat st;
+	cache_header header;
+	bool ok = fstat(fd, &st) == 0 &&
+			  (st.st_size > 0 || init_table(fd, CACHE_INITIAL_SLOTS, 0)) &&
+			  pread(fd, &header, sizeof(header), 0) == sizeof(header);
+	flock(fd, LOCK_UN);
+	if(!ok || memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) ||
+	   header.version != CACHE_VERSION)
+	{
+		fprintf(stderr, "%s: not a metrics cache\n", c->path);
+		close(fd);
+		return false;
+	}
+	if(header.wordsize != WORDSIZE ||
+	   header.sparse_canon_min_n != SPARSE_CANON_MIN_N)
+	{
+		fprintf(stderr, "%s: made with WORDSIZE = %u and "
+				"SPARSE_CANON_MIN_N = %u\n", c->path, header.wordsize,
+				header.sparse_canon_min_n);
+		close(fd);
+		return false;
+	}
+
+	size_t map_len = sizeof(cache_header) + header.num_slots * sizeof(cache_slot);
+	void *map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED)
+	{
+		perror(c->path);
+		close(fd);
+		return false;
+	}
+	c->fd = fd;
+	c->map_len = map_len;
+	c->header = map;
+	c->slots = (cache_slot*) (c->header + 1);
+	return true;
+}
+
+static void unmap_table(metrics_cache *c)
+{
+	munmap(c->header, c->map_len);
+	close(c->fd);
+}
+
+//Opens the table at path (and its graph6 file, path.g6), creating
+//them if they don't exist yet
+metrics_cache *metrics_cache_open(const char *path)
+{
+	metrics_cache *c = malloc(sizeof(metrics_cache));
+	c->path = strdup(path);
+	if(!map_table(c))
+	{
+		free(c->path);
+		free(c);
+		return NULL;
+	}
+
+	char *data_path = malloc(strlen(path) + sizeof(".g6"));
+	sprintf(data_path, "%s.g6", path);
+	c->data_fd = open(data_path, O_RDWR | O_CREAT | O_APPEND, 0666);
+	if(c->data_fd < 0)
+	{
+		perror(data_path);
+		free(data_path);
+		unmap_table(c);
+		free(c->path);
+		free(c);
+		return NULL;
+	}
+	free(data_path);
+
+	c->data = NULL;
+	c->data_len = 0;
+	c->pending = NULL;
+	c->num_pending = c->pending_capacity = 0;
+	c->lookups = c->hits = 0;
+	return c;
+}
+
+//Flushes whatever is still pending
+void metrics_cache_close(metrics_cache *c)
+{
+	metrics_cache_flush(c);
+	free(c->pending);
+	unmap_table(c);
+	if(c->data)
+		munmap((void*) c->data, c->data_len);
+	close(c->data_fd);
+	free(c->path);
+	free(c);
+}
+
+//Sets child's key (see cache.h): parent must be labelled canonically
+//and have its fingerprint, and child is parent plus a last vertex
+//joined to neighbours
+void metrics_cache_key(graph_info *parent, unsigned *neighbours,
+					   unsigned size, graph_info *child)
+{
+	//in increasing order, however they were enumerated
+	unsigned sorted[MAX_K];
+	for(unsigned j = 0; j < size; j++)
+	{
+		unsigned i = j;
+		for(; i > 0 && sorted[i - 1] > neighbours[j]; i--)
+			sorted[i] = sorted[i - 1];
+		sorted[i] = neighbours[j];
+	}
+
+	unsigned long lo = parent->fingerprint, hi = parent->fingerprint_hi;
+	for(unsigned j = 0; j < size; j++)
+	{
+		lo = (lo ^ (sorted[j] + 1)) * 0x9e3779b97f4a7c15UL;
+		lo ^= lo >> 32;
+		hi = (hi + sorted[j] + 1) * 0xff51afd7ed558ccdUL;
+		hi ^= hi >> 29;
+	}
+	child->cache_key = lo;
+	child->cache_key_hi = hi ? hi : 1;
+}
+
+//Returns the slot with this key, or the empty slot where it would go,
+//or NULL if the table is full
+static cache_slot *find_slot(cache_slot *slots, uint64_t num_slots,
+							 uint64_t lo, uint64_t hi)
+{
+	uint64_t mask = num_slots - 1;
+	for(uint64_t i = 0; i <= mask; i++)
+	{
+		cache_slot *slot = &slots[(lo + i) & mask];
+		uint64_t slot_hi = __atomic_load_n(&slot->key_hi, __ATOMIC_ACQUIRE);
+		if(slot_hi == 0 || (slot_hi == hi && slot->key_lo == lo))
+			return slot;
+	}
+	return NULL;
+}
+
+static bool key_is_new(metrics_cache *c, const cache_key *key)
+{
+	cache_slot *slot = find_slot(c->slots, c->header->num_slots, key->lo,
+								 key->hi);
+	return slot && slot->key_hi == 0;
+}
+
+//Maps path.g6 up to at least end, if it's that long
+static bool map_data(metrics_cache *c, uint64_t end)
+{
+	if(end <= c->data_len)
+		return true;
+	struct stat st;
+	if(fstat(c->data_fd, &st) || (uint64_t) st.st_size < end)
+		return false;
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, c->data_fd, 0);
+	if(map == MAP_FAILED)
+		return false;
+	if(c->data)
+		munmap((void*) c->data, c->data_len);
+	c->data = map;
+	c->data_len = st.st_size;
+	return true;
+}
+
+//If g (a child with a key, and its score) is in the table, reads its
+//canonical form from there and fills in its fingerprint, so that
+//calc_gcan() has nothing left to do
+bool metrics_cache_lookup(metrics_cache *c, graph_info *g)
+{
+	c->lookups++;
+	cache_slot *slot = find_slot(c->slots, c->header->num_slots,
+								 g->cache_key, g->cache_key_hi);
+	//the score is a check against the (unlikely) collision of keys
+	if(!slot || slot->key_hi == 0 || slot->n != g->n || slot->m != g->m ||
+	   slot->sum_of_distances != g->sum_of_distances ||
+	   slot->diameter != g->diameter ||
+	   !map_data(c, slot->g6_offset + G6LEN(g->n)))
+		return false;
+
+	char g6[G6LEN(g->n) + 1];
+	memcpy(g6, c->data + slot->g6_offset, G6LEN(g->n));
+	g6[G6LEN(g->n)] = '\0';
+	int m = (g->n + WORDSIZE - 1) / WORDSIZE;
+	g->gcan = malloc(g->n * m * sizeof(setword));
+	stringtograph(g6, g->gcan, m);
+	calc_fingerprint(g);
+	c->hits++;
+	return true;
+}
+
+//Queues g (which must have its canonical form and score) to be added
+//under each of keys by the next metrics_cache_flush(), which skips the
+//keys that are in the table by then
+void metrics_cache_add(metrics_cache *c, const cache_key *keys,
+					   unsigned num_keys, graph_info *g)
+{
+	if(c->num_pending == c->pending_capacity)
+	{
+		c->pending_capacity = c->pending_capacity ? 2 * c->pending_capacity
+												  : 1024;
+		c->pending = realloc(c->pending,
+							 c->pending_capacity * sizeof(cache_pending));
+	}
+	int m = (g->n + WORDSIZE - 1) / WORDSIZE;
+	cache_pending *p = &c->pending[c->num_pending++];
+	p->keys = malloc(num_keys * sizeof(cache_key));
+	memcpy(p->keys, keys, num_keys * sizeof(cache_key));
+	p->num_keys = num_keys;
+	p->n = g->n;
+	p->m = g->m;
+	p->sum_of_distances = g->sum_of_distances;
+	p->diameter = g->diameter;
+	p->g6 = strdup(ntog6(g->gcan, m, g->n));
+}
+
+//Locks the table, first switching to the one at path if another
+//process has replaced it (see grow_table())
+static bool lock_table(metrics_cache *c)
+{
+	for(;;)
+	{
+		flock(c->fd, LOCK_EX);
+		struct stat st_path, st_fd;
+		if(stat(c->path, &st_path) || fstat(c->fd, &st_fd))
+			return true; //nothing better to switch to
+		if(st_path.st_ino == st_fd.st_ino && st_path.st_dev == st_fd.st_dev)
+			return true;
+		flock(c->fd, LOCK_UN);
+
+		cache_header *header = c->header;
+		size_t map_len = c->map_len;
+		int fd = c->fd;
+		if(!map_table(c))
+			return false;
+		munmap(header, map_len);
+		close(fd);
+	}
+}
+
+//Replaces the (locked) table by one big enough for num_used slots,
+//which is renamed over it and comes back locked
+static bool grow_table(metrics_cache *c, uint64_t num_used)
+{
+	uint64_t num_slots = c->header->num_slots;
+	while(num_used > num_slots / 4 * 3)
+		num_slots *= 2;
+
+	char *tmp_path = malloc(strlen(c->path) + sizeof(".tmp"));
+	sprintf(tmp_path, "%s.tmp", c->path);
+	int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	size_t map_len = sizeof(cache_header) + num_slots * sizeof(cache_slot);
+	void *map = MAP_FAILED;
+	if(fd >= 0 && init_table(fd, num_slots, c->header->num_used))
+		map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED)
+	{
+		perror(tmp_path);
+		if(fd >= 0)
+			close(fd);
+		unlink(tmp_path);
+		free(tmp_path);
+		return false;
+	}
+
+	cache_slot *slots = (cache_slot*) ((cache_header*) map + 1);
+	for(uint64_t i = 0; i < c->header->num_slots; i++)
+		if(c->slots[i].key_hi)
+			*find_slot(slots, num_slots, c->slots[i].key_lo,
+					   c->slots[i].key_hi) = c->slots[i];
+
+	//whoever opens the new table has to wait for this flush to finish
+	flock(fd, LOCK_EX);
+	if(rename(tmp_path, c->path))
+	{
+		perror(c->path);
+		munmap(map, map_len);
+		close(fd);
+		unlink(tmp_path);
+		free(tmp_path);
+		return false;
+	}
+	free(tmp_path);
+
+	unmap_table(c);
+	c->fd = fd;
+	c->map_len = map_len;
+	c->header = map;
+	c->slots = slots;
+	return true;
+}
+
+//Appends the pending graphs' graph6 strings to path.g6 with a single
+//write, and then publishes their slots. Returns false on a write error.
+bool metrics_cache_flush(metrics_cache *c)
+{
+	if(c->num_pending == 0)
+		return true;
+	if(!lock_table(c))
+		return false;
+
+	//another process may have added some of them since
+	uint64_t num_new = 0;
+	size_t len = 0;
+	for(unsigned i = 0; i < c->num_pending; i++)
+	{
+		cache_pending *p = &c->pending[i];
+		unsigned num_keys = 0;
+		for(unsigned j = 0; j < p->num_keys; j++)
+			if(key_is_new(c, &p->keys[j]))
+				p->keys[num_keys++] = p->keys[j];
+		p->num_keys = num_keys;
+		num_new += num_keys;
+		if(num_keys)
+			len += strlen(p->g6);
+	}
+
+	bool ok = c->header->num_used + num_new <= c->header->num_slots / 4 * 3 ||
+			  grow_table(c, c->header->num_used + num_new);
+
+	char *buf = malloc(len);
+	size_t buf_len = 0;
+	for(unsigned i = 0; i < c->num_pending; i++)
+	{
+		size_t g6_len = strlen(c->pending[i].g6);
+		if(c->pending[i].num_keys)
+		{
+			memcpy(buf + buf_len, c->pending[i].g6, g6_len);
+			buf_len += g6_len;
+		}
+	}
+	off_t end = lseek(c->data_fd, 0, SEEK_END);
+	ok = ok && end >= 0 && write(c->data_fd, buf, len) == (ssize_t) len;
+	free(buf);
+
+	//the slot's contents have to be visible before its key
+	off_t offset = end;
+	for(unsigned i = 0; ok && i < c->num_pending; i++)
+	{
+		cache_pending *p = &c->pending[i];
+		if(!p->num_keys)
+			continue;
+		size_t g6_len = strlen(p->g6);
+		for(unsigned j = 0; j < p->num_keys; j++)
+		{
+			cache_slot *slot = find_slot(c->slots, c->header->num_slots,
+										 p->keys[j].lo, p->keys[j].hi);
+			if(slot->key_hi != 0)
+				continue; //a duplicate from earlier in pending
+			slot->key_lo = p->keys[j].lo;
+			slot->n = p->n;
+			slot->m = p->m;
+			slot->sum_of_distances = p->sum_of_distances;
+			slot->diameter = p->diameter;
+			slot->g6_offset = offset;
+			__atomic_store_n(&slot->key_hi, p->keys[j].hi, __ATOMIC_RELEASE);
+			c->header->num_used++;
+		}
+		offset += g6_len;
+	}
+	if(!ok)
+		perror("metrics cache");
+
+	flock(c->fd, LOCK_UN);
+
+	for(unsigned i = 0; i < c->num_pending; i++)
+	{
+		free(c->pending[i].keys);
+		free(c->pending[i].g6);
+	}
+	c->num_pending = 0;
+	return ok;
+}
@@ -0,0 +1,87 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "graph.h"
+#include <stdint.h>
+
+//Persistent canonical forms of children, shared between runs.
+//A child is keyed by its parent's 128-bit fingerprint and the
+//neighbours of its new vertex, with the parent labelled canonically
+//(see graph_info_expand()), so the key is the same in every run and
+//is known before the child is canonicalized (see metrics_cache_key()).
+//The table is a file of fixed-size slots (open addressing, linear
+//probing), which every process maps MAP_SHARED. Each slot holds n, m,
+//the sum of distances, the diameter and the offset of the child's
+//canonical form in a second file, path.g6, which only grows. Children
+//reached from several parents share one graph6 string.
+//Slots are never moved or deleted, and a slot's key is published last
+//(with release semantics), so any number of processes can look graphs
+//up without locking. Writers buffer new graphs and add them all at
+//once in metrics_cache_flush(), under an exclusive flock() of the table.
+//A table that gets 3/4 full is replaced by one twice the size, which
+//is renamed over it; other processes switch to it at their next flush.
+
+//Slots in a newly created table
+#define CACHE_INITIAL_SLOTS (1UL << 16)
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t wordsize; //canonical forms depend on it
+	uint32_t sparse_canon_min_n; //and on which backend made them
+	uint32_t unused;
+	uint64_t num_slots; //a power of two
+	uint64_t num_used;
+} cache_header;
+
+//n and the diameter are at most MAX_N
+typedef struct {
+	uint64_t key_lo;
+	uint64_t key_hi; //0 if the slot is empty; never 0 otherwise
+	uint64_t g6_offset; //of G6LEN(n) characters and a newline
+	uint32_t sum_of_distances;
+	uint16_t m;
+	uint8_t n, diameter;
+} cache_slot;
+
+typedef struct {
+	uint64_t lo, hi;
+} cache_key;
+
+typedef struct {
+	cache_key *keys;
+	unsigned num_keys;
+	uint32_t n, m;
+	uint32_t sum_of_distances, diameter;
+	char *g6;
+} cache_pending;
+
+typedef struct {
+	char *path;
+	int fd, data_fd;
+	size_t map_len;
+	cache_header *header;
+	cache_slot *slots;
+
+	//path.g6, mapped as far as it had been written the last time a
+	//lookup needed more of it
+	const char *data;
+	size_t data_len;
+
+	//graphs added since the last flush
+	cache_pending *pending;
+	unsigned num_pending, pending_capacity;
+
+	unsigned long lookups, hits;
+} metrics_cache;
+
+metrics_cache *metrics_cache_open(const char *path);
+void metrics_cache_close(metrics_cache *c);
+void metrics_cache_key(graph_info *parent, unsigned *neighbours,
+					   unsigned size, graph_info *child);
+bool metrics_cache_lookup(metrics_cache *c, graph_info *g);
+void metrics_cache_add(metrics_cache *c, const cache_key *keys,
+					   unsigned num_keys, graph_info *g);
+bool metrics_cache_flush(metrics_cache *c);
+
+#endif
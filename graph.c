@@ -1,4 +1,11 @@
+#define _POSIX_C_SOURCE 200809L
 #include "graph.h"
+#include "naututil.h"
+#include "nausparse.h"
+#include "gtools.h"
+#include <string.h>
+#include <limits.h>
+#include <time.h>
 #include <stdbool.h>
 
 void print_graph(graph_info g)
@@ -14,12 +21,16 @@ void print_graph(graph_info g)
 		printf("%d ", g.k[i]);
 	printf("\n");
 
-	unsigned m = (g.n + WORDSIZE - 1) / WORDSIZE;
 	for(int i = 0; i < g.n; i++)
 	{
+		bool row[g.n];
+		for(int j = 0; j < g.n; j++)
+			row[j] = false;
+		for(int j = 0; j < g.k[i]; j++)
+			row[ADJ(&g, i)[j]] = true;
 		for(int j = 0; j < g.n; j++)
 		{
-			if(ISELEMENT(GRAPHROW(g.nauty_graph, i, m), j))
+			if(row[j])
 				printf("1, ");
 			else
 				printf("0, ");
@@ -44,6 +55,77 @@ void floyd_warshall(graph_info g) {
 	}
 }
 
+//All pairs shortest paths by a BFS from each vertex over g.adj,
+//which is O(n * m) rather than O(n^3) for our sparse graphs
+void bfs_distances(graph_info g)
+{
+	int queue[g.n];
+	for(int s = 0; s < g.n; s++)
+	{
+		int *dist = g.distances + g.n*s;
+		for(int i = 0; i < g.n; i++)
+			dist[i] = GRAPH_INFINITY;
+		dist[s] = 0;
+		queue[0] = s;
+		int head = 0, tail = 1;
+		while(head < tail)
+		{
+			int u = queue[head++];
+			int *neighbours = ADJ(&g, u);
+			for(int j = 0; j < g.k[u]; j++)
+			{
+				int v = neighbours[j];
+				if(dist[v] == GRAPH_INFINITY)
+				{
+					dist[v] = dist[u] + 1;
+					queue[tail++] = v;
+				}
+			}
+		}
+	}
+}
+
+//Tarjan's lowpoint DFS from u, which was reached at depth
+static int cut_vertex_dfs(graph_info *g, int u, int parent, int depth,
+						  int *depths, bool *cut)
+{
+	depths[u] = depth;
+	int low = depth, num_children = 0;
+	for(int j = 0; j < g->k[u]; j++)
+	{
+		int w = ADJ(g, u)[j];
+		if(w == parent)
+			continue;
+		if(depths[w] >= 0)
+		{
+			if(depths[w] < low)
+				low = depths[w];
+			continue;
+		}
+		num_children++;
+		int child_low = cut_vertex_dfs(g, w, u, depth + 1, depths, cut);
+		if(child_low < low)
+			low = child_low;
+		if(parent >= 0 && child_low >= depth)
+			cut[u] = true;
+	}
+	if(parent < 0 && num_children > 1)
+		cut[u] = true;
+	return low;
+}
+
+//Sets cut[u] iff removing u disconnects the (connected) graph g
+void find_cut_vertices(graph_info *g, bool *cut)
+{
+	int depths[g->n];
+	for(int i = 0; i < g->n; i++)
+	{
+		depths[i] = -1;
+		cut[i] = false;
+	}
+	cut_vertex_dfs(g, 0, -1, 0, depths, cut);
+}
+
 void fill_dist_matrix(graph_info g)
 {
 	//Figure out distance from new node to each other node
@@ -111,44 +193,447 @@ int calc_diameter(graph_info g)
 	return diameter;
 }
 
+static void canon_dense(graph *g, int n, graph *gcan, int *lab, int *orbits)
+{
+	int m = (n + WORDSIZE - 1) / WORDSIZE;
+	
+	DEFAULTOPTIONS_GRAPH(options);
+	statsblk stats;
+	setword workspace[m * 50];
+	int ptn[n];
+	
+	options.getcanon = true;
+	
+	nauty(g, lab, ptn, NULL, orbits,
+		  &options, &stats, workspace, 50 * m, m, n, gcan);
+}
+
+//Same as canon_dense(), but refines the adjacency arrays directly as a
+//sparsegraph (with MAX_K slots per vertex), which is O(n * MAX_K) per
+//step rather than O(n^2 / WORDSIZE).
+//The canonical labelling is not the same as canon_dense()'s.
+static void canon_sparse(int *adj, int *k, int n, graph *gcan, int *lab,
+						 int *orbits)
+{
+	int m = (n + WORDSIZE - 1) / WORDSIZE;
+	int v[n], cv[n], cd[n], ce[n * MAX_K];
+	
+	sparsegraph sg, cg;
+	sg.nv = cg.nv = n;
+	sg.nde = 0;
+	for(int i = 0; i < n; i++)
+	{
+		v[i] = i * MAX_K;
+		sg.nde += k[i];
+	}
+	sg.v = v; sg.d = k; sg.e = adj; sg.w = NULL;
+	cg.v = cv; cg.d = cd; cg.e = ce; cg.w = NULL;
+	sg.vlen = sg.dlen = cg.vlen = cg.dlen = n;
+	sg.elen = cg.elen = n * MAX_K;
+	sg.wlen = cg.wlen = 0;
+	
+	DEFAULTOPTIONS_SPARSEGRAPH(options);
+	statsblk stats;
+	setword workspace[m * 50];
+	int ptn[n];
+	
+	options.getcanon = true;
+	
+	nauty((graph*) &sg, lab, ptn, NULL, orbits,
+		  &options, &stats, workspace, 50 * m, m, n, (graph*) &cg);
+	sg_to_nauty(&cg, gcan, m, &m);
+}
+
+//Fills in rows (n * m setwords) from the adjacency arrays
+static void adj_to_rows(int *adj, int *k, int n, graph *rows)
+{
+	int m = (n + WORDSIZE - 1) / WORDSIZE;
+	EMPTYSET(rows, n * m);
+	for(int i = 0; i < n; i++)
+		for(int j = 0; j < k[i]; j++)
+			ADDELEMENT(GRAPHROW(rows, i, m), adj[MAX_K*i + j]);
+}
+
+//graph6 string (with a newline) of g's canonical form, or of g as it's
+//labelled if it has none (see level.fingerprint_only), to be freed
+char *graph_info_g6(graph_info *g)
+{
+	int m = (g->n + WORDSIZE - 1) / WORDSIZE;
+	if(g->gcan)
+		return strdup(ntog6(g->gcan, m, g->n));
+	setword rows[g->n * m];
+	adj_to_rows(g->adj, g->k, g->n, rows);
+	return strdup(ntog6(rows, m, g->n));
+}
+
+static unsigned long num_canon_calls;
+
+//Runs nauty on g, into g->gcan
+static void canonicalize(graph_info *g, int *lab, int *orbits)
+{
+	num_canon_calls++;
+	if(g->n >= SPARSE_CANON_MIN_N)
+		canon_sparse(g->adj, g->k, g->n, g->gcan, lab, orbits);
+	else if(g->nauty_graph)
+		canon_dense(g->nauty_graph, g->n, g->gcan, lab, orbits);
+	else
+	{
+		int m = (g->n + WORDSIZE - 1) / WORDSIZE;
+		setword rows[g->n * m];
+		adj_to_rows(g->adj, g->k, g->n, rows);
+		canon_dense(rows, g->n, g->gcan, lab, orbits);
+	}
+	calc_fingerprint(g);
+}
+
+//Computes the canonical form of g into g->gcan, if it hasn't been
+//computed already. Dense rows are only built (temporarily) if
+//g->nauty_graph isn't there and the dense backend is used.
+//The canonical form depends on n (see SPARSE_CANON_MIN_N), so only
+//compare canonical forms of graphs with the same number of vertices.
+void calc_gcan(graph_info *g)
+{
+	if(g->gcan)
+		return;
+	
+	int m = (g->n + WORDSIZE - 1) / WORDSIZE;
+	g->gcan = malloc(g->n * m * sizeof(setword));
+	int lab[g->n], orbits[g->n];
+	canonicalize(g, lab, orbits);
+}
+
+//Same as calc_gcan() (g->gcan must not be there yet), but also gives
+//the canonical labelling, where vertex lab[i] of g becomes vertex i,
+//and the orbits of g's automorphism group (orbits[u] is the least
+//vertex in u's orbit)
+void calc_gcan_orbits(graph_info *g, int *lab, int *orbits)
+{
+	int m = (g->n + WORDSIZE - 1) / WORDSIZE;
+	g->gcan = malloc(g->n * m * sizeof(setword));
+	canonicalize(g, lab, orbits);
+}
+
+//Number of times nauty has been run so far
+unsigned long canon_num_calls(void)
+{
+	return num_canon_calls;
+}
+
+//Two independent 64-bit hashes of the canonical form, used in place of
+//it wherever a collision only costs a full comparison. Together they
+//can stand in for it entirely (see level.fingerprint_only).
+void calc_fingerprint(graph_info *g)
+{
+	int m = (g->n + WORDSIZE - 1) / WORDSIZE;
+	unsigned long h = 0xcbf29ce484222325UL;
+	unsigned long h_hi = 0x84222325cbf29ce4UL ^ g->n;
+	for(int i = 0; i < g->n * m; i++)
+	{
+		h = (h ^ g->gcan[i]) * 0x9e3779b97f4a7c15UL;
+		h ^= h >> 32;
+		h_hi = (h_hi + g->gcan[i]) * 0xff51afd7ed558ccdUL;
+		h_hi ^= h_hi >> 29;
+	}
+	g->fingerprint = h;
+	g->fingerprint_hi = h_hi;
+}
+
+//Orders graphs by sum of distances, then diameter.
+//Returns <0, 0 or >0 like strcmp()
+int graph_info_compare_score(graph_info *g1, graph_info *g2)
+{
+	if(g1->sum_of_distances != g2->sum_of_distances)
+		return g1->sum_of_distances < g2->sum_of_distances ? -1 : 1;
+	if(g1->diameter != g2->diameter)
+		return g1->diameter < g2->diameter ? -1 : 1;
+	return 0;
+}
+
+//Total order on graphs: score first, then the canonical form (by its
+//fingerprint, and only comparing the rows themselves if those match).
+//Which graphs survive a level must not depend on the order they were
+//generated in, so ties are always broken the same way.
+//Both graphs must have their canonical form computed (see calc_gcan()),
+//or at least their fingerprint (see graph_info_compare_gcan()).
+int graph_info_compare(graph_info *g1, graph_info *g2)
+{
+	int ret = graph_info_compare_score(g1, g2);
+	if(ret)
+		return ret;
+	if(g1->n != g2->n)
+		return g1->n < g2->n ? -1 : 1;
+	if(g1->fingerprint != g2->fingerprint)
+		return g1->fingerprint < g2->fingerprint ? -1 : 1;
+	if(g1->fingerprint_hi != g2->fingerprint_hi)
+		return g1->fingerprint_hi < g2->fingerprint_hi ? -1 : 1;
+	return graph_info_compare_gcan(g1, g2);
+}
+
+//Fills in the adjacency arrays, degrees and number of edges from rows,
+//whose degrees must be at most MAX_K
+static void adj_from_rows(graph_info *g, graph *rows)
+{
+	int n = g->n;
+	int m = (n + WORDSIZE - 1) / WORDSIZE;
+	g->adj = malloc(n * MAX_K * sizeof(*g->adj));
+	g->k = malloc(n * sizeof(*g->k));
+	
+	g->m = 0; //total number of edges
+	g->max_k = 0;
+	for (int i = 0; i < n; i++) {
+		g->k[i] = 0;
+		set *row = GRAPHROW(rows, i, m);
+		for (int j = -1; (j = nextelement(row, m, j)) >= 0; )
+			ADJ(g, i)[g->k[i]++] = j;
+		g->m += g->k[i];
+		if (g->k[i] > g->max_k)
+			g->max_k = g->k[i];
+	}
+	g->m /= 2;
+}
+
 graph_info *graph_info_from_nauty(graph *g, int n)
 {
 	graph_info *ret = malloc(sizeof(graph_info));
+	int m = (n + WORDSIZE - 1) / WORDSIZE;
 	ret->n = n;
+	ret->nauty_graph = malloc(n * m * sizeof(graph));
+	ret->gcan = NULL;
+	ret->fingerprint = ret->fingerprint_hi = 0;
+	ret->parent = NULL;
+	ret->frozen_adj = NULL;
+	ret->new_degree = 0;
+	ret->cache_key = ret->cache_key_hi = 0;
+	memcpy(ret->nauty_graph, g, n * m * sizeof(graph));
+	
+	adj_from_rows(ret, g);
 	ret->distances = malloc(n * n * sizeof(*ret->distances));
-	ret->k = malloc(n * sizeof(*ret->k));
+	bfs_distances(*ret);
+	ret->sum_of_distances = calc_sum(*ret);
+	ret->diameter = calc_diameter(*ret);
+	
+	return ret;
+}
 
-	int m = (n + WORDSIZE - 1) / WORDSIZE;
-	ret->m = 0; //total number of edges
-	for (int i = 0; i < n; i++) {
-		ret->k[i] = 0;
-		for (int j = 0; j < n; j++) {
-			if(i == j)
-				ret->distances[n*i + j] = 0;
-			else if(ISELEMENT(GRAPHROW(g, i, m), j))
+//Adds the edge ij, keeping the adjacency arrays, degrees and the
+//rows (if there are any) in sync. Distances are left alone.
+void graph_info_add_edge(graph_info *g, int i, int j)
+{
+	ADJ(g, i)[g->k[i]++] = j;
+	ADJ(g, j)[g->k[j]++] = i;
+	if(g->k[i] > g->max_k)
+		g->max_k = g->k[i];
+	if(g->k[j] > g->max_k)
+		g->max_k = g->k[j];
+	g->m++;
+	if(g->nauty_graph)
+	{
+		int m = (g->n + WORDSIZE - 1) / WORDSIZE;
+		ADDELEMENT(GRAPHROW(g->nauty_graph, i, m), j);
+		ADDELEMENT(GRAPHROW(g->nauty_graph, j, m), i);
+	}
+}
+
+static void remove_neighbour(graph_info *g, int i, int j)
+{
+	int *neighbours = ADJ(g, i);
+	for(int slot = 0; slot < g->k[i]; slot++)
+	{
+		if(neighbours[slot] == j)
+		{
+			neighbours[slot] = neighbours[--g->k[i]];
+			return;
+		}
+	}
+}
+
+//Undoes graph_info_add_edge()
+void graph_info_remove_edge(graph_info *g, int i, int j)
+{
+	remove_neighbour(g, i, j);
+	remove_neighbour(g, j, i);
+	g->m--;
+	g->max_k = 0;
+	for(int v = 0; v < g->n; v++)
+		if(g->k[v] > g->max_k)
+			g->max_k = g->k[v];
+	if(g->nauty_graph)
+	{
+		int m = (g->n + WORDSIZE - 1) / WORDSIZE;
+		DELELEMENT(GRAPHROW(g->nauty_graph, i, m), j);
+		DELELEMENT(GRAPHROW(g->nauty_graph, j, m), i);
+	}
+}
+
+//Drops everything but the canonical form and the score.
+//This is all a graph needs while it sits in a level; use
+//graph_info_expand() to get the rest back (relabelled canonically).
+//Graphs with a parent keep their new vertex's neighbours instead, and
+//only the fingerprint of their canonical form.
+void graph_info_compact(graph_info *g)
+{
+	if(!g->parent)
+		calc_gcan(g);
+	else
+	{
+		if(g->adj)
+			for(int j = 0; j < g->k[g->n - 1]; j++)
+				g->new_neighbours[j] = ADJ(g, g->n - 1)[j];
+		free(g->gcan);
+		g->gcan = NULL;
+	}
+	free(g->distances);
+	free(g->k);
+	free(g->adj);
+	free(g->nauty_graph);
+	g->distances = NULL;
+	g->k = NULL;
+	g->adj = NULL;
+	g->nauty_graph = NULL;
+}
+
+//The parent's adjacency arrays plus the last vertex, labelled as when
+//g was compacted. A parent that's compact itself (in the level that's
+//still being extended) gets its arrays back just for this, from its
+//own (frozen) parent.
+static void adj_from_parent(graph_info *g)
+{
+	graph_info *parent = g->parent;
+	g->adj = malloc(g->n * MAX_K * sizeof(*g->adj));
+	g->k = malloc(g->n * sizeof(*g->k));
+	bool parent_compact = !parent->adj && !parent->frozen_adj;
+	if(parent_compact && parent->parent)
+		adj_from_parent(parent);
+	else if(parent_compact)
+		adj_from_rows(parent, parent->gcan);
+	
+	if(parent->frozen_adj)
+	{
+		for(int u = 0; u < parent->n; u++)
+		{
+			unsigned char *neighbours = parent->frozen_adj + MAX_K * u;
+			g->k[u] = 0;
+			while(g->k[u] < MAX_K && neighbours[g->k[u]] != UCHAR_MAX)
 			{
-				ret->distances[n*i + j] = 1;
-				ret->k[i]++;
-				ret->m++;
+				ADJ(g, u)[g->k[u]] = neighbours[g->k[u]];
+				g->k[u]++;
 			}
-			else
-				ret->distances[n*i + j] = GRAPH_INFINITY;
 		}
 	}
-	ret->m /= 2;
+	else
+	{
+		memcpy(g->adj, parent->adj, parent->n * MAX_K * sizeof(*g->adj));
+		memcpy(g->k, parent->k, parent->n * sizeof(*g->k));
+	}
+	int v = g->n - 1, num_new = g->m - parent->m;
+	g->k[v] = 0;
+	g->m = parent->m;
+	g->max_k = parent->max_k;
+	for(int j = 0; j < num_new; j++)
+		graph_info_add_edge(g, g->new_neighbours[j], v);
 	
-	ret->max_k = 0;
-	for (int i = 0; i < n; i++)
-		if (ret->k[i] > ret->max_k)
-			ret->max_k = ret->k[i];
+	if(parent_compact)
+	{
+		free(parent->adj);
+		free(parent->k);
+		parent->adj = NULL;
+		parent->k = NULL;
+	}
+}
+
+//Undoes graph_info_compact()
+void graph_info_expand(graph_info *g)
+{
+	if(g->distances)
+		return;
 	
-	floyd_warshall(*ret);
-	ret->sum_of_distances = calc_sum(*ret);
-	ret->diameter = calc_diameter(*ret);
-	ret->nauty_graph = malloc(n * m * sizeof(graph));
-	ret->gcan = NULL;
-	memcpy(ret->nauty_graph, g, n * m * sizeof(graph));
+	if(!g->adj && g->parent)
+		adj_from_parent(g);
+	else if(!g->adj)
+		adj_from_rows(g, g->gcan);
+	g->distances = malloc(g->n * g->n * sizeof(*g->distances));
+	bfs_distances(*g);
+}
+
+//Leaves only frozen_adj (and the score), without reference to the
+//parent, for graphs that are the parents of compacted graphs (see
+//level_freeze()). That's a byte per slot, less than even the canonical
+//form.
+void graph_info_freeze(graph_info *g)
+{
+	if(!g->adj)
+	{
+		if(g->parent)
+			adj_from_parent(g);
+		else
+			adj_from_rows(g, g->gcan);
+	}
+	g->frozen_adj = malloc(g->n * MAX_K);
+	for(int u = 0; u < g->n; u++)
+		for(int j = 0; j < MAX_K; j++)
+			g->frozen_adj[MAX_K * u + j] = j < g->k[u] ? ADJ(g, u)[j] :
+										   UCHAR_MAX;
+	free(g->distances);
+	free(g->k);
+	free(g->adj);
+	free(g->nauty_graph);
+	free(g->gcan);
+	g->distances = NULL;
+	g->k = NULL;
+	g->adj = NULL;
+	g->nauty_graph = NULL;
+	g->gcan = NULL;
+	g->parent = NULL;
+}
+
+//g's canonical form, or if it only has its parent (see level.delta),
+//one recomputed from that, which the caller frees. NULL if it has
+//neither (see level.fingerprint_only).
+static graph *gcan_to_compare(graph_info *g)
+{
+	if(g->gcan || !g->parent)
+		return g->gcan;
 	
+	bool compact = !g->adj;
+	if(compact)
+		adj_from_parent(g);
+	calc_gcan(g);
+	graph *ret = g->gcan;
+	g->gcan = NULL;
+	if(compact)
+	{
+		free(g->adj);
+		free(g->k);
+		g->adj = NULL;
+		g->k = NULL;
+	}
+	return ret;
+}
+
+//Orders two graphs with the same n by their canonical form, like
+//strcmp(). Only needed once their fingerprints match, which is why
+//graphs in a delta level can do without it until then. The
+//fingerprint is all there is of graphs in a fingerprint_only level,
+//so those compare equal.
+int graph_info_compare_gcan(graph_info *g1, graph_info *g2)
+{
+	if(g1 == g2)
+		return 0;
+	graph *gcan1 = gcan_to_compare(g1), *gcan2 = gcan_to_compare(g2);
+	int ret = 0;
+	int m = (g1->n + WORDSIZE - 1) / WORDSIZE;
+	for(int i = 0; gcan1 && gcan2 && i < g1->n * m; i++)
+	{
+		if(gcan1[i] != gcan2[i])
+		{
+			ret = gcan1[i] < gcan2[i] ? -1 : 1;
+			break;
+		}
+	}
+	if(gcan1 != g1->gcan)
+		free(gcan1);
+	if(gcan2 != g2->gcan)
+		free(gcan2);
 	return ret;
 }
 
@@ -156,9 +641,11 @@ void graph_info_destroy(graph_info *g)
 {
 	free(g->distances);
 	free(g->k);
+	free(g->adj);
 	free(g->nauty_graph);
 	if(g->gcan)
 	  free(g->gcan);
+	free(g->frozen_adj);
 	free(g);
 }
 
@@ -168,18 +655,110 @@ graph_info *new_graph_info(graph_info src)
 	int m = (src.n + WORDSIZE - 1) / WORDSIZE;
 	ret->n = src.n;
 	ret->distances = malloc(ret->n * ret->n * sizeof(*ret->distances));
-	ret->nauty_graph = malloc(ret->n * m * sizeof(setword));
+	ret->adj = malloc(ret->n * MAX_K * sizeof(*ret->adj));
 	ret->k = malloc(ret->n * sizeof(*ret->k));
 	ret->m = src.m;
 	ret->max_k = src.max_k;
-	if(src.gcan)
-		ret->gcan = malloc(ret->n * m * sizeof(setword));
+	ret->sum_of_distances = src.sum_of_distances;
+	ret->diameter = src.diameter;
+	ret->fingerprint = src.fingerprint;
+	ret->fingerprint_hi = src.fingerprint_hi;
+	ret->parent = src.parent;
+	ret->frozen_adj = NULL;
+	ret->new_degree = src.new_degree;
+	ret->cache_key = src.cache_key;
+	ret->cache_key_hi = src.cache_key_hi;
+	memcpy(ret->new_neighbours, src.new_neighbours, sizeof(src.new_neighbours));
 	memcpy(ret->distances, src.distances, src.n * src.n * sizeof(*src.distances));
 	memcpy(ret->k, src.k, src.n * sizeof(int));
-	memcpy(ret->nauty_graph, src.nauty_graph, src.n * m * sizeof(setword));
+	memcpy(ret->adj, src.adj, src.n * MAX_K * sizeof(int));
+	if(src.nauty_graph)
+	{
+		ret->nauty_graph = malloc(ret->n * m * sizeof(setword));
+		memcpy(ret->nauty_graph, src.nauty_graph, src.n * m * sizeof(setword));
+	}
+	else
+		ret->nauty_graph = NULL;
 	if(src.gcan)
+	{
+		ret->gcan = malloc(ret->n * m * sizeof(setword));
 		memcpy(ret->gcan, src.gcan, src.n * m * sizeof(setword));
+	}
 	else
 		ret->gcan = NULL;
 	return ret;
-}
\ No newline at end of file
+}
+
+//Random connected graph on n vertices with degrees at most max_k:
+//a random tree, plus random edges until no more fit (or we give up)
+static void random_graph(graph *g, int n, int max_k)
+{
+	int m = (n + WORDSIZE - 1) / WORDSIZE;
+	int k[n];
+	EMPTYSET(g, n * m);
+	for(int i = 0; i < n; i++)
+		k[i] = 0;
+	for(int i = 1; i < n; i++)
+	{
+		int j;
+		do
+			j = rand() % i;
+		while(k[j] >= max_k);
+		ADDELEMENT(GRAPHROW(g, i, m), j);
+		ADDELEMENT(GRAPHROW(g, j, m), i);
+		k[i]++;
+		k[j]++;
+	}
+	for(int tries = 0; tries < 4 * n; tries++)
+	{
+		int i = rand() % n, j = rand() % n;
+		if(i == j || k[i] >= max_k || k[j] >= max_k ||
+		   ISELEMENT(GRAPHROW(g, i, m), j))
+			continue;
+		ADDELEMENT(GRAPHROW(g, i, m), j);
+		ADDELEMENT(GRAPHROW(g, j, m), i);
+		k[i]++;
+		k[j]++;
+	}
+}
+
+//Times dense and sparse canonicalization of random graphs with max
+//degree MAX_K, which is how SPARSE_CANON_MIN_N was picked
+void canon_benchmark(void)
+{
+	printf("n\tdense (us)\tsparse (us)\n");
+	for(int n = 8; n <= MAX_N; n += n < 64 ? 8 : 32)
+	{
+		int m = (n + WORDSIZE - 1) / WORDSIZE;
+		int reps = 200000 / n;
+		graph *g = malloc(n * m * sizeof(graph));
+		graph *gcan = malloc(n * m * sizeof(graph));
+		graph_info info;
+		info.n = n;
+		int lab[n], orbits[n];
+		double times[2] = {0, 0};
+		srand(n);
+		for(int rep = 0; rep < reps; rep++)
+		{
+			random_graph(g, n, MAX_K);
+			adj_from_rows(&info, g);
+			for(int sparse = 0; sparse < 2; sparse++)
+			{
+				struct timespec start, end;
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				if(sparse)
+					canon_sparse(info.adj, info.k, n, gcan, lab, orbits);
+				else
+					canon_dense(g, n, gcan, lab, orbits);
+				clock_gettime(CLOCK_MONOTONIC, &end);
+				times[sparse] += (end.tv_sec - start.tv_sec) * 1e6 +
+								 (end.tv_nsec - start.tv_nsec) / 1e3;
+			}
+			free(info.adj);
+			free(info.k);
+		}
+		printf("%d\t%.2f\t\t%.2f\n", n, times[0] / reps, times[1] / reps);
+		free(g);
+		free(gcan);
+	}
+}
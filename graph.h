@@ -2,6 +2,7 @@
 
 
 #include "nauty.h"
+#include <stdbool.h>
 
 //Represents when there is no connection
 //graph.c adds stuff to infinity (crazy, I know),
@@ -12,9 +13,14 @@
 //(See main.c)
 #define MAX_K 3
 #define P 500
+//Children are scored with distances stored as uint8 (see score.h)
+#define MAX_N 255
+//Canonicalize graphs with at least this many vertices through nausparse
+//(see canon_benchmark())
+#define SPARSE_CANON_MIN_N 32
 
 
-typedef struct {
+typedef struct graph_info {
 	int n;
 	int *distances;
 	int sum_of_distances;
@@ -22,17 +28,69 @@ typedef struct {
 	int *k;
 	int diameter;
 	int max_k;
+	//neighbours of each vertex, in MAX_K slots per vertex (see ADJ())
+	int *adj;
+	//nauty_graph is optional: graphs built by the search don't have it,
+	//and rows are only produced when canonicalizing (see calc_gcan())
 	graph *nauty_graph, *gcan;
+	//two independent hashes of gcan (a 128-bit fingerprint), set by
+	//calc_gcan()
+	unsigned long fingerprint, fingerprint_hi;
+	//If set, the graph is parent plus a last vertex joined to
+	//new_neighbours (m - parent->m of them), and that's all
+	//graph_info_compact() keeps besides the score and fingerprint (see
+	//level.delta)
+	struct graph_info *parent;
+	unsigned char new_neighbours[MAX_K];
+	//All that's left of a graph frozen as a parent besides the score
+	//(see graph_info_freeze()): MAX_K neighbours per vertex, like adj,
+	//with UCHAR_MAX in empty slots
+	unsigned char *frozen_adj;
+	//Degree of the last vertex if the graph was made by extending a
+	//parent, 0 otherwise (see level_allocate())
+	unsigned char new_degree;
+	//Key of the graph in the metrics cache (see metrics_cache_key()),
+	//from its parent and its new vertex's neighbours; 0 if it has none
+	unsigned long cache_key, cache_key_hi;
 } graph_info;
 
+//The k[i] neighbours of vertex i
+#define ADJ(g, i) ((g)->adj + MAX_K * (i))
+
+//Sum of distances and diameter packed so that comparing scores is
+//a single integer comparison
+static inline unsigned long graph_info_score(graph_info *g)
+{
+	return (unsigned long) g->sum_of_distances << 32 | g->diameter;
+}
+
+//Callback for walking over a set of graphs; return false to stop early
+typedef bool (*graph_visit_func)(graph_info *g, void *data);
+
 graph_info *new_graph_info(graph_info src);
 graph_info *graph_info_from_nauty(graph *g, int n);
 void graph_info_destroy(graph_info *g);
+void graph_info_add_edge(graph_info *g, int i, int j);
+void graph_info_remove_edge(graph_info *g, int i, int j);
+void graph_info_compact(graph_info *g);
+void graph_info_expand(graph_info *g);
+void graph_info_freeze(graph_info *g);
 void floyd_warshall(graph_info g);
+void bfs_distances(graph_info g);
+void find_cut_vertices(graph_info *g, bool *cut);
 void fill_dist_matrix(graph_info g);
 void print_graph(graph_info g);
+char *graph_info_g6(graph_info *g);
 int calc_sum(graph_info g);
 int calc_diameter(graph_info g);
+void calc_gcan(graph_info *g);
+void calc_gcan_orbits(graph_info *g, int *lab, int *orbits);
+unsigned long canon_num_calls(void);
+void calc_fingerprint(graph_info *g);
+void canon_benchmark(void);
+int graph_info_compare_score(graph_info *g1, graph_info *g2);
+int graph_info_compare(graph_info *g1, graph_info *g2);
+int graph_info_compare_gcan(graph_info *g1, graph_info *g2);
 
 
 #define GRAPH_H
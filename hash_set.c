@@ -1,6 +1,8 @@
+#define _POSIX_C_SOURCE 200809L
 #include "hash_set.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
 
 static _bucket_t *bucket_create(void *ptr)
 {
@@ -190,3 +192,139 @@ void hash_set_test(void)
 	
 	hash_set_delete(set);
 }
+
+static inline unsigned long test_key_hash(unsigned long *key)
+{
+	unsigned long h = *key * 0x9e3779b97f4a7c15UL;
+	return h ^ (h >> 31);
+}
+
+static inline bool test_key_equal(unsigned long *key1, unsigned long *key2)
+{
+	return *key1 == *key2;
+}
+
+DEFINE_STRIPED_HASH_SET(test_set, unsigned long*, test_key_hash,
+						test_key_equal)
+
+#define TEST_NUM_KEYS (1 << 18)
+#define TEST_NUM_THREADS 16
+
+typedef struct {
+	test_set *set;
+	unsigned long *keys;
+	unsigned begin, end, step;
+	unsigned offset;
+	pthread_barrier_t *barrier;
+	unsigned long added, found, removed;
+} test_worker;
+
+//Adds, looks up and removes keys[begin], keys[begin + step], ... below
+//end, starting at the offset-th of them and wrapping around, counting
+//successes. Every thread finishes each pass before any starts the next,
+//so a key can't be removed before all the threads have tried to add it.
+static void *test_worker_main(void *data)
+{
+	test_worker *w = data;
+	unsigned num = (w->end - w->begin + w->step - 1) / w->step;
+	w->added = w->found = w->removed = 0;
+	for(int pass = 0; pass < 3; pass++)
+	{
+		for(unsigned j = 0; j < num; j++)
+		{
+			unsigned long *key = &w->keys[w->begin +
+										  (j + w->offset) % num * w->step];
+			if(pass == 0)
+				w->added += test_set_add(w->set, key);
+			else if(pass == 1)
+				w->found += test_set_contains(w->set, key);
+			else
+				w->removed += test_set_remove(w->set, key);
+		}
+		pthread_barrier_wait(w->barrier);
+	}
+	return NULL;
+}
+
+static void run_test_workers(test_set *set, unsigned long *keys,
+							 unsigned num_threads, bool overlap,
+							 test_worker *workers)
+{
+	pthread_t threads[num_threads];
+	pthread_barrier_t barrier;
+	pthread_barrier_init(&barrier, NULL, num_threads);
+	for(unsigned t = 0; t < num_threads; t++)
+	{
+		workers[t].set = set;
+		workers[t].keys = keys;
+		workers[t].begin = overlap ? 0 : t;
+		workers[t].end = TEST_NUM_KEYS;
+		workers[t].step = overlap ? 1 : num_threads;
+		//overlapping threads start spread out over the same keys
+		workers[t].offset = overlap ? t * (TEST_NUM_KEYS / num_threads) : 0;
+		workers[t].barrier = &barrier;
+		pthread_create(&threads[t], NULL, test_worker_main, &workers[t]);
+	}
+	for(unsigned t = 0; t < num_threads; t++)
+		pthread_join(threads[t], NULL);
+	pthread_barrier_destroy(&barrier);
+}
+
+//Has TEST_NUM_THREADS threads race to add and then remove the same
+//keys, and checks that each key was added and removed exactly once,
+//and that every thread found every key in between
+void striped_set_test(void)
+{
+	unsigned long *keys = malloc(TEST_NUM_KEYS * sizeof(unsigned long));
+	for(unsigned i = 0; i < TEST_NUM_KEYS; i++)
+		keys[i] = i;
+	test_set set;
+	test_set_init(&set, 8, 0); //few stripes, and lots of growing
+	
+	test_worker workers[TEST_NUM_THREADS];
+	run_test_workers(&set, keys, TEST_NUM_THREADS, true, workers);
+	unsigned long added = 0, found = 0, removed = 0;
+	for(unsigned t = 0; t < TEST_NUM_THREADS; t++)
+	{
+		added += workers[t].added;
+		found += workers[t].found;
+		removed += workers[t].removed;
+	}
+	if(added != TEST_NUM_KEYS || removed != TEST_NUM_KEYS ||
+	   found != (unsigned long) TEST_NUM_THREADS * TEST_NUM_KEYS ||
+	   test_set_size(&set) != 0)
+		printf("Error: %lu of %d keys added, %lu found, %lu removed, "
+			   "%lu left\n", added, TEST_NUM_KEYS, found, removed,
+			   test_set_size(&set));
+	else
+		printf("striped set: %d threads added and removed %d keys once "
+			   "each\n", TEST_NUM_THREADS, TEST_NUM_KEYS);
+	
+	test_set_fini(&set);
+	free(keys);
+}
+
+//Times threads adding, finding and removing disjoint keys, for 1, 2,
+//4, ... max_threads threads
+void striped_set_benchmark(unsigned max_threads)
+{
+	unsigned long *keys = malloc(TEST_NUM_KEYS * sizeof(unsigned long));
+	for(unsigned i = 0; i < TEST_NUM_KEYS; i++)
+		keys[i] = i;
+	printf("threads\tMops/s\n");
+	for(unsigned num_threads = 1; num_threads <= max_threads; num_threads *= 2)
+	{
+		test_set set;
+		test_set_init(&set, 1024, TEST_NUM_KEYS);
+		test_worker workers[num_threads];
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		run_test_workers(&set, keys, num_threads, false, workers);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double secs = (end.tv_sec - start.tv_sec) +
+					  (end.tv_nsec - start.tv_nsec) / 1e9;
+		printf("%u\t%.2f\n", num_threads, 3 * TEST_NUM_KEYS / secs / 1e6);
+		test_set_fini(&set);
+	}
+	free(keys);
+}
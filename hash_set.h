@@ -1,7 +1,9 @@
 #ifndef __HASH_SET_H__
 #define __HASH_SET_H__
 
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdlib.h>
 
 typedef unsigned long (*hash_func)(void *elem);
 typedef bool (*compare_func)(void *elem1, void *elem2);
@@ -29,4 +31,218 @@ bool hash_set_remove(hash_set *set, void *elem);
 bool hash_set_contains(hash_set *set, void *ptr);
 unsigned hash_set_size(hash_set *set);
 
+//Generates an open addressing (linear probing) set type called name,
+//holding elements of type, along with static functions name_init(),
+//name_add(), etc. mirroring the generic hash_set API above.
+//type must be a pointer type; NULL marks an empty slot. hash(elem) and
+//equal(elem1, elem2) are inlined, and each slot keeps the hash next to
+//the element so that probing only dereferences elements on a hash match.
+#define DEFINE_HASH_SET(name, type, hash, equal) \
+typedef struct { \
+	unsigned long hash; \
+	type elem; \
+} name##_slot; \
+\
+typedef struct { \
+	name##_slot *slots; \
+	unsigned capacity; /* power of two */ \
+	unsigned size; \
+} name; \
+\
+static inline bool name##_init(name *set, unsigned expected_size) \
+{ \
+	set->capacity = 16; \
+	while(set->capacity < 2 * expected_size) \
+		set->capacity *= 2; \
+	set->size = 0; \
+	set->slots = calloc(set->capacity, sizeof(name##_slot)); \
+	return set->slots != NULL; \
+} \
+\
+static inline void name##_fini(name *set) \
+{ \
+	free(set->slots); \
+} \
+\
+/* Returns the slot holding elem, or the empty slot where it would go */ \
+static inline name##_slot *name##_find_(name##_slot *slots, unsigned capacity, \
+										unsigned long hash_, type elem) \
+{ \
+	unsigned i = hash_ & (capacity - 1); \
+	while(slots[i].elem && \
+		  (slots[i].hash != hash_ || !equal(slots[i].elem, elem))) \
+		i = (i + 1) & (capacity - 1); \
+	return &slots[i]; \
+} \
+\
+static inline bool name##_grow_(name *set) \
+{ \
+	unsigned capacity = 2 * set->capacity; \
+	name##_slot *slots = calloc(capacity, sizeof(name##_slot)); \
+	if(!slots) \
+		return false; \
+	for(unsigned i = 0; i < set->capacity; i++) \
+		if(set->slots[i].elem) \
+			*name##_find_(slots, capacity, set->slots[i].hash, \
+						  set->slots[i].elem) = set->slots[i]; \
+	free(set->slots); \
+	set->slots = slots; \
+	set->capacity = capacity; \
+	return true; \
+} \
+\
+/* Returns false if an equal element is already in the set */ \
+static inline bool name##_add(name *set, type elem) \
+{ \
+	if(2 * (set->size + 1) > set->capacity && !name##_grow_(set)) \
+		return false; \
+	unsigned long hash_ = hash(elem); \
+	name##_slot *slot = name##_find_(set->slots, set->capacity, hash_, elem); \
+	if(slot->elem) \
+		return false; \
+	slot->hash = hash_; \
+	slot->elem = elem; \
+	set->size++; \
+	return true; \
+} \
+\
+static inline bool name##_contains(name *set, type elem) \
+{ \
+	return name##_find_(set->slots, set->capacity, hash(elem), elem)->elem \
+		   != NULL; \
+} \
+\
+/* Returns the element equal to elem, or NULL if there isn't one */ \
+static inline type name##_find(name *set, type elem) \
+{ \
+	return name##_find_(set->slots, set->capacity, hash(elem), elem)->elem; \
+} \
+\
+/* Removes the element equal to elem, shifting back the rest of its */ \
+/* probe sequence so that no tombstones are needed */ \
+static inline bool name##_remove(name *set, type elem) \
+{ \
+	unsigned mask = set->capacity - 1; \
+	name##_slot *slot = name##_find_(set->slots, set->capacity, hash(elem), \
+									 elem); \
+	if(!slot->elem) \
+		return false; \
+	unsigned hole = slot - set->slots; \
+	for(unsigned i = (hole + 1) & mask; set->slots[i].elem; i = (i + 1) & mask) \
+	{ \
+		unsigned home = set->slots[i].hash & mask; \
+		/* move it if its home isn't cyclically in (hole, i] */ \
+		if(((i - home) & mask) >= ((i - hole) & mask)) \
+		{ \
+			set->slots[hole] = set->slots[i]; \
+			hole = i; \
+		} \
+	} \
+	set->slots[hole].elem = NULL; \
+	set->size--; \
+	return true; \
+} \
+\
+static inline unsigned name##_size(name *set) \
+{ \
+	return set->size; \
+}
+
+//Generates a set type called name that any number of threads can add
+//to and remove from at once, with static functions name_init(),
+//name_add(), etc. It's split into stripes, each a DEFINE_HASH_SET set
+//behind its own mutex: the top bits of an element's hash pick its
+//stripe (and the low bits its slot in there), so hash must mix its
+//high bits well. Threads only wait for each other on the same stripe.
+#define DEFINE_STRIPED_HASH_SET(name, type, hash, equal) \
+DEFINE_HASH_SET(name##_stripe, type, hash, equal) \
+\
+typedef struct { \
+	pthread_mutex_t lock; \
+	name##_stripe set; \
+	char pad[64]; /* keep stripes' locks off each other's cache lines */ \
+} name##_locked_stripe; \
+\
+typedef struct { \
+	name##_locked_stripe *stripes; \
+	unsigned long mask; /* number of stripes - 1 */ \
+} name; \
+\
+static inline bool name##_init(name *set, unsigned num_stripes, \
+							   unsigned expected_size) \
+{ \
+	unsigned long size = 1; \
+	while(size < num_stripes) \
+		size *= 2; \
+	set->mask = size - 1; \
+	set->stripes = malloc(size * sizeof(name##_locked_stripe)); \
+	if(!set->stripes) \
+		return false; \
+	for(unsigned long i = 0; i < size; i++) \
+	{ \
+		pthread_mutex_init(&set->stripes[i].lock, NULL); \
+		name##_stripe_init(&set->stripes[i].set, expected_size / size); \
+	} \
+	return true; \
+} \
+\
+static inline void name##_fini(name *set) \
+{ \
+	for(unsigned long i = 0; i <= set->mask; i++) \
+	{ \
+		pthread_mutex_destroy(&set->stripes[i].lock); \
+		name##_stripe_fini(&set->stripes[i].set); \
+	} \
+	free(set->stripes); \
+} \
+\
+static inline name##_locked_stripe *name##_stripe_of_(name *set, type elem) \
+{ \
+	return &set->stripes[(hash(elem) >> 40) & set->mask]; \
+} \
+\
+/* Returns false if an equal element is already in the set */ \
+static inline bool name##_add(name *set, type elem) \
+{ \
+	name##_locked_stripe *stripe = name##_stripe_of_(set, elem); \
+	pthread_mutex_lock(&stripe->lock); \
+	bool ret = name##_stripe_add(&stripe->set, elem); \
+	pthread_mutex_unlock(&stripe->lock); \
+	return ret; \
+} \
+\
+static inline bool name##_contains(name *set, type elem) \
+{ \
+	name##_locked_stripe *stripe = name##_stripe_of_(set, elem); \
+	pthread_mutex_lock(&stripe->lock); \
+	bool ret = name##_stripe_contains(&stripe->set, elem); \
+	pthread_mutex_unlock(&stripe->lock); \
+	return ret; \
+} \
+\
+static inline bool name##_remove(name *set, type elem) \
+{ \
+	name##_locked_stripe *stripe = name##_stripe_of_(set, elem); \
+	pthread_mutex_lock(&stripe->lock); \
+	bool ret = name##_stripe_remove(&stripe->set, elem); \
+	pthread_mutex_unlock(&stripe->lock); \
+	return ret; \
+} \
+\
+/* Only exact while no other thread is adding or removing */ \
+static inline unsigned long name##_size(name *set) \
+{ \
+	unsigned long size = 0; \
+	for(unsigned long i = 0; i <= set->mask; i++) \
+	{ \
+		pthread_mutex_lock(&set->stripes[i].lock); \
+		size += name##_stripe_size(&set->stripes[i].set); \
+		pthread_mutex_unlock(&set->stripes[i].lock); \
+	} \
+	return size; \
+}
+
+void striped_set_test(void);
+void striped_set_benchmark(unsigned max_threads);
+
 #endif
\ No newline at end of file
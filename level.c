@@ -1,55 +1,14 @@
 #include "level.h"
+#include "score.h"
 #include "naututil.h"
 #include <string.h>
-
-//Hash set implementation/callbacks
-
-static unsigned long nauty_hash(void *elem)
-{
-	graph_info *graph = elem;
-	int m = (graph->n + WORDSIZE - 1) / WORDSIZE;
-	return (unsigned long) hash(graph->gcan, m * graph->n, 15);
-}
-
-static bool nauty_compare(void *elem1, void *elem2)
-{
-	graph_info *graph1 = elem1, *graph2 = elem2;
-	if (graph1->n != graph2->n)
-		return false;
-	
-	graph *g1 = graph1->gcan, *g2 = graph2->gcan;
-	int m = (graph1->n + WORDSIZE - 1) / WORDSIZE;
-	return !memcmp(g1, g2, graph1->n * m * sizeof(setword));
-}
-
-static void nauty_delete(void *elem)
-{
-}
-
-//Priority queue implementation/callbacks
-
-static bool graph_compare_gt(void *elem1, void *elem2)
-{
-	graph_info *graph1 = elem1, *graph2 = elem2;
-	
-	if(graph1->sum_of_distances > graph2->sum_of_distances)
-		return true;
-	else if(graph1->sum_of_distances < graph2->sum_of_distances)
-		return false;
-	return graph1->diameter > graph2->diameter;
-}
-
-static void graph_delete(void *elem)
-{
-	graph_info *graph = elem;
-	graph_info_destroy(graph);
-}
-
+#include <limits.h>
+#include <stdint.h>
 
 level *level_create(unsigned n, unsigned p, unsigned max_k)
 {
 	//make sure max_k is sane
-	if(max_k < 2 || max_k > (n - 1))
+	if(max_k < 2 || max_k > (n - 1) || max_k > MAX_K)
 		return NULL;
 	level *ret = malloc(sizeof(level));
 	ret->n = n;
@@ -58,15 +17,30 @@ level *level_create(unsigned n, unsigned p, unsigned max_k)
 	ret->min_m = n - 1;
 	ret->num_m = (n * max_k / 2) - ret->min_m + 1;
 	
-	ret->sets = malloc(ret->num_m * sizeof(hash_set*));
-	ret->queues = malloc(ret->num_m * sizeof(priority_queue*));
+	ret->hot_p = 0;
+	ret->spills = NULL;
+	ret->compact = false;
+	ret->cache = NULL;
+	ret->cache_notes = NULL;
+	ret->num_cache_notes = ret->cache_notes_capacity = 0;
+	ret->canonical_augmentation = false;
+	ret->delta = false;
+	ret->num_shards = 0;
+	ret->shard_thresholds = NULL;
+	ret->fingerprint_only = false;
+	ret->verify_every = 0;
+	ret->caps = NULL;
+	ret->num_parents = NULL;
+	
+	ret->sets = malloc(ret->num_m * sizeof(graph_set));
+	ret->queues = malloc(ret->num_m * sizeof(graph_queue));
+	ret->thresholds = malloc(ret->num_m * sizeof(unsigned long));
 	
 	for(int i = 0; i < ret->num_m; i++)
 	{
-		ret->sets[i] = hash_set_create(P * 3 / 2, nauty_hash, nauty_compare,
-									   nauty_delete);
-		ret->queues[i] = priority_queue_create(graph_compare_gt,
-											   graph_delete);
+		graph_set_init(&ret->sets[i], p);
+		graph_queue_init(&ret->queues[i]);
+		ret->thresholds[i] = ULONG_MAX;
 	}
 	
 	return ret;
@@ -75,102 +49,536 @@ level *level_create(unsigned n, unsigned p, unsigned max_k)
 void level_delete(level *my_level)
 {
 	for(int i = 0; i < my_level->num_m; i++)
-		hash_set_delete(my_level->sets[i]);
+		graph_set_fini(&my_level->sets[i]);
 	free(my_level->sets);
 	
 	for(int i = 0; i < my_level->num_m; i++)
-		priority_queue_delete(my_level->queues[i]);
+	{
+		graph_queue *queue = &my_level->queues[i];
+		while(graph_queue_num_elems(queue))
+			graph_info_destroy(graph_queue_pull(queue).graph);
+		graph_queue_fini(queue);
+	}
 	free(my_level->queues);
+	if(!my_level->num_shards)
+		free(my_level->thresholds);
+	free(my_level->caps);
+	free(my_level->num_parents);
+	free(my_level->cache_notes);
+	
+	if(my_level->spills)
+	{
+		for(int i = 0; i < my_level->num_m; i++)
+			spill_delete(my_level->spills[i]);
+		free(my_level->spills);
+	}
 	
 	free(my_level);
 }
 
+static int pointer_compare(const void *elem1, const void *elem2)
+{
+	uintptr_t p1 = (uintptr_t) *(graph_info**) elem1;
+	uintptr_t p2 = (uintptr_t) *(graph_info**) elem2;
+	return p1 < p2 ? -1 : p1 > p2;
+}
+
+//Deletes old once new has been built from it (with delta set), except
+//for the parents of new's graphs, which are frozen (see
+//graph_info_freeze()) and returned in *frozen_ret. Those can only be
+//deleted (see level_frozen_delete()) once new has been frozen in turn,
+//or deleted.
+//Returns the number of frozen graphs.
+unsigned level_freeze(level *old, level *new, graph_info ***frozen_ret)
+{
+	unsigned num_graphs = 0;
+	for(unsigned i = 0; i < new->num_m; i++)
+		num_graphs += graph_queue_num_elems(&new->queues[i]);
+	graph_entry *entries = malloc(num_graphs * sizeof(graph_entry));
+	graph_info **frozen = malloc(num_graphs * sizeof(graph_info*));
+	unsigned num_frozen = 0;
+	for(unsigned i = 0; i < new->num_m; i++)
+	{
+		graph_queue_sorted(&new->queues[i], entries);
+		for(unsigned j = 0; j < graph_queue_num_elems(&new->queues[i]); j++)
+			if(entries[j].graph->parent)
+				frozen[num_frozen++] = entries[j].graph->parent;
+	}
+	free(entries);
+	
+	qsort(frozen, num_frozen, sizeof(graph_info*), pointer_compare);
+	unsigned num_unique = 0;
+	for(unsigned j = 0; j < num_frozen; j++)
+		if(num_unique == 0 || frozen[j] != frozen[num_unique - 1])
+			frozen[num_unique++] = frozen[j];
+	num_frozen = num_unique;
+	
+	for(unsigned i = 0; i < old->num_m; i++)
+	{
+		graph_queue *queue = &old->queues[i];
+		while(graph_queue_num_elems(queue))
+		{
+			graph_info *g = graph_queue_pull(queue).graph;
+			if(bsearch(&g, frozen, num_frozen, sizeof(graph_info*),
+					   pointer_compare))
+				graph_info_freeze(g);
+			else
+				graph_info_destroy(g);
+		}
+	}
+	level_delete(old);
+	
+	*frozen_ret = frozen;
+	return num_frozen;
+}
+
+void level_frozen_delete(graph_info **frozen, unsigned num_frozen)
+{
+	for(unsigned j = 0; j < num_frozen; j++)
+		graph_info_destroy(frozen[j]);
+	free(frozen);
+}
+
+//Keep at most hot_p graphs for each m in memory, and write the rest
+//to temporary files in dir. Must be called before any graphs are added.
+bool level_set_spill(level *my_level, unsigned hot_p, const char *dir)
+{
+	my_level->hot_p = hot_p;
+	my_level->spills = calloc(my_level->num_m, sizeof(spill*));
+	for(int i = 0; i < my_level->num_m; i++)
+	{
+		my_level->spills[i] = spill_create(dir, my_level->n, my_level->p);
+		if(!my_level->spills[i])
+			return false;
+		
+		//the hash sets only need to hold the hot graphs now
+		graph_set_fini(&my_level->sets[i]);
+		graph_set_init(&my_level->sets[i], hot_p);
+	}
+	return true;
+}
+
+typedef struct {
+	graph_visit_func func;
+	void *data;
+} visit_state;
+
+//Compact graphs and graphs read back from disk only have their
+//canonical form, so recompute everything else before handing them out
+static bool materialize_visit(graph_info *g, void *data)
+{
+	visit_state *state = data;
+	if(g->distances)
+		return state->func(g, state->data);
+	
+	graph_info_expand(g);
+	bool ret = state->func(g, state->data);
+	graph_info_compact(g);
+	return ret;
+}
+
+//Calls func on each graph with m = i + min_m, best first, until it
+//returns false. The graphs are only valid for the duration of the call.
+void level_foreach(level *my_level, unsigned i, graph_visit_func func,
+				   void *data)
+{
+	graph_queue *queue = &my_level->queues[i];
+	unsigned num_hot = graph_queue_num_elems(queue);
+	graph_entry *sorted = malloc(num_hot * sizeof(graph_entry));
+	graph_queue_sorted(queue, sorted);
+	graph_info **hot = malloc(num_hot * sizeof(graph_info*));
+	for(unsigned j = 0; j < num_hot; j++)
+		hot[j] = sorted[j].graph;
+	free(sorted);
+	
+	visit_state state = {func, data};
+	if(my_level->spills)
+		spill_merge(my_level->spills[i], hot, num_hot, materialize_visit,
+					&state);
+	else
+	{
+		for(unsigned j = 0; j < num_hot; j++)
+			if(!materialize_visit(hot[j], &state))
+				break;
+	}
+	
+	free(hot);
+}
+
+static bool print_visit(graph_info *g, void *data)
+{
+	print_graph(*g);
+	return true;
+}
+
 void level_empty_and_print(level *my_level)
 {
 	printf("For n = %u\n", my_level->n);
 	for(int i = 0; i < my_level->num_m; i++)
 	{
 		printf("m = %u:\n", i + my_level->min_m);
-		while(priority_queue_num_elems(my_level->queues[i]))
+		level_foreach(my_level, i, print_visit, NULL);
+		while(graph_queue_num_elems(&my_level->queues[i]))
 		{
-			graph_info *g = priority_queue_pull(my_level->queues[i]);
-			print_graph(*g);
+			graph_info *g = graph_queue_pull(&my_level->queues[i]).graph;
 			graph_info_destroy(g);
 		}
 	}
 }
 
-bool add_graph_to_level(graph_info *new_graph, level *my_level)
+//Publishes the level's thresholds in shard_thresholds[self] (in memory
+//shared with the other shards, which are in the same state), and rejects
+//what any of shard_thresholds rejects. Must be called before any graphs
+//are added.
+void level_share_thresholds(level *my_level, unsigned long **shard_thresholds,
+							unsigned num_shards, unsigned self)
 {
-	unsigned i = new_graph->m - my_level->min_m;
+	free(my_level->thresholds);
+	my_level->thresholds = shard_thresholds[self];
+	for(unsigned i = 0; i < my_level->num_m; i++)
+		my_level->thresholds[i] = ULONG_MAX;
+	my_level->num_shards = num_shards;
+	my_level->shard_thresholds = shard_thresholds;
+}
+
+//Drops all but the best keep graphs with m = min_m + i
+void level_truncate(level *my_level, unsigned i, unsigned keep)
+{
+	graph_queue *queue = &my_level->queues[i];
+	while(graph_queue_num_elems(queue) > keep)
+	{
+		graph_info *g = graph_queue_pull(queue).graph;
+		graph_set_remove(&my_level->sets[i], g);
+		graph_info_destroy(g);
+	}
+}
+
+//Spreads p graphs per bucket of new (which is about to be built from
+//old) over its buckets, by how well the same number of cycles (m - n + 1,
+//which is also the bucket's index) did before: how many children per
+//parent the level old was built from got into old, and how much of
+//old's bucket is tied at its cutoff. Buckets that can't reach the
+//densest graphs with max_n vertices any more, and buckets whose
+//children never make it, get p / 4, so that every m still has a beam.
+//Only looks at what's in old, so like the rest of the level it doesn't
+//depend on the order graphs were generated in.
+void level_allocate(level *old, level *new, unsigned max_n)
+{
+	new->num_parents = malloc(old->num_m * sizeof(unsigned));
+	for(unsigned i = 0; i < old->num_m; i++)
+		new->num_parents[i] = graph_queue_num_elems(&old->queues[i]);
+	if(!old->num_parents)
+		return; //nothing to go on yet, so every bucket gets p
 	
-	if(priority_queue_num_elems(my_level->queues[i]) >= my_level->p &&
-	   graph_compare_gt(new_graph,
-						priority_queue_peek(my_level->queues[i])))
-		return false;
+	//buckets of the level old was built from
+	unsigned prev_num_m = (old->n - 1) * old->max_k / 2 - (old->n - 2) + 1;
+	unsigned long survivors[prev_num_m];
+	for(unsigned j = 0; j < prev_num_m; j++)
+		survivors[j] = 0;
+	double tied[old->num_m];
+	for(unsigned i = 0; i < old->num_m; i++)
+	{
+		graph_queue *queue = &old->queues[i];
+		unsigned num = graph_queue_num_elems(queue);
+		graph_entry *entries = malloc(num * sizeof(graph_entry));
+		graph_queue_sorted(queue, entries);
+		unsigned num_tied = 0;
+		for(unsigned j = 0; j < num; j++)
+		{
+			unsigned degree = entries[j].graph->new_degree;
+			if(degree && i + 1 >= degree && i + 1 - degree < prev_num_m)
+				survivors[i + 1 - degree]++;
+			if(graph_entry_sum(entries[j]) == graph_entry_sum(entries[num - 1]))
+				num_tied++;
+		}
+		free(entries);
+		tied[i] = num && num >= level_cap(old, i) ? (double) num_tied / num
+												   : 0;
+	}
 	
-	if(!new_graph->gcan)
+	//each vertex adds at most max_k - 1 cycles
+	unsigned top = max_n * new->max_k / 2 - (max_n - 1);
+	unsigned reach = (new->max_k - 1) * (max_n - new->n);
+	double weight[new->num_m], total_weight = 0;
+	for(unsigned i = 0; i < new->num_m; i++)
 	{
-		int m = (new_graph->n + WORDSIZE - 1) / WORDSIZE;
-		
-		DEFAULTOPTIONS_GRAPH(options);
-		statsblk stats;
-		setword workspace[m * 50];
-		int lab[new_graph->n], ptn[new_graph->n], orbits[new_graph->n];
-		new_graph->gcan = malloc(new_graph->n * m * sizeof(setword));
-		
-		options.getcanon = true;
+		if(i + reach < top)
+		{
+			weight[i] = 0;
+			continue;
+		}
+		unsigned j = i < prev_num_m ? i : prev_num_m - 1;
+		unsigned t = i < old->num_m ? i : old->num_m - 1;
+		weight[i] = (survivors[j] + 1.0) / (old->num_parents[j] + 1.0) *
+					(1 + tied[t]);
+		total_weight += weight[i];
+	}
+	
+	unsigned floor = new->p / 4 ? new->p / 4 : 1;
+	double spare = ((double) new->p - floor) * new->num_m;
+	new->caps = malloc(new->num_m * sizeof(unsigned));
+	for(unsigned i = 0; i < new->num_m; i++)
+		new->caps[i] = floor + spare * weight[i] / total_weight;
+}
+
+//True if no graph with m edges and this score (see graph_info_score())
+//can get into my_level anymore, before even building the graph
+bool level_rejects_score(level *my_level, unsigned m, unsigned long score)
+{
+	unsigned i = m - my_level->min_m;
+	
+	if(my_level->spills && spill_rejects(my_level->spills[i], score))
+		return true;
+	
+	//a shard with a full bucket already has enough graphs that beat it
+	for(unsigned s = 0; s < my_level->num_shards; s++)
+		if(score > __atomic_load_n(&my_level->shard_thresholds[s][i],
+								   __ATOMIC_RELAXED))
+			return true;
+	
+	return score > __atomic_load_n(&my_level->thresholds[i], __ATOMIC_RELAXED);
+}
+
+//Duplicates found by fingerprint alone (see level.fingerprint_only)
+static struct {
+	unsigned long duplicates, verified, collisions;
+	//sum over every lookup of the chance that a different graph in
+	//the set has the same fingerprint
+	double expected_collisions;
+} dedupe_stats;
+
+//Compares g's canonical form to that of the graph whose fingerprint it
+//matched, recomputed from its adjacency
+static void verify_duplicate(level *my_level, unsigned i, graph_info *g)
+{
+	dedupe_stats.duplicates++;
+	if(!my_level->verify_every ||
+	   dedupe_stats.duplicates % my_level->verify_every)
+		return;
+	
+	graph_set *set = &my_level->sets[i];
+	graph_info *match = graph_set_find(set, g);
+	graph_info *copy = new_graph_info(*match);
+	calc_gcan(copy);
+	int m = (g->n + WORDSIZE - 1) / WORDSIZE;
+	dedupe_stats.verified++;
+	if(memcmp(copy->gcan, g->gcan, g->n * m * sizeof(setword)))
+		dedupe_stats.collisions++;
+	graph_info_destroy(copy);
+}
+
+void level_print_dedupe_stats(void)
+{
+	if(!dedupe_stats.duplicates)
+		return;
+	printf("fingerprint dedupe: %lu duplicates, %lu verified, %lu collisions "
+		   "(%.3g expected)\n", dedupe_stats.duplicates,
+		   dedupe_stats.verified, dedupe_stats.collisions,
+		   dedupe_stats.expected_collisions);
+}
+
+static void note_cached(level *my_level, graph_info *g)
+{
+	if(my_level->num_cache_notes == my_level->cache_notes_capacity)
+	{
+		my_level->cache_notes_capacity = my_level->cache_notes_capacity ?
+										 2 * my_level->cache_notes_capacity :
+										 1024;
+		my_level->cache_notes = realloc(my_level->cache_notes,
+										my_level->cache_notes_capacity *
+										sizeof(cache_note));
+	}
+	cache_note *note = &my_level->cache_notes[my_level->num_cache_notes++];
+	note->key.lo = g->cache_key;
+	note->key.hi = g->cache_key_hi;
+	note->fingerprint = g->fingerprint;
+	note->fingerprint_hi = g->fingerprint_hi;
+	note->m = g->m;
+}
+
+static int note_compare(const void *elem1, const void *elem2)
+{
+	const cache_note *n1 = elem1, *n2 = elem2;
+	if(n1->m != n2->m)
+		return n1->m < n2->m ? -1 : 1;
+	if(n1->fingerprint != n2->fingerprint)
+		return n1->fingerprint < n2->fingerprint ? -1 : 1;
+	if(n1->fingerprint_hi != n2->fingerprint_hi)
+		return n1->fingerprint_hi < n2->fingerprint_hi ? -1 : 1;
+	return 0;
+}
+
+//Adds the noted children that are still in the level to its cache,
+//each under every key it was reached by, and flushes the cache
+void level_record_cache(level *my_level)
+{
+	qsort(my_level->cache_notes, my_level->num_cache_notes,
+		  sizeof(cache_note), note_compare);
+	unsigned num_keys = 0;
+	cache_key *keys = malloc(my_level->num_cache_notes * sizeof(cache_key));
+	for(unsigned j = 0; j < my_level->num_cache_notes; j++)
+	{
+		cache_note *note = &my_level->cache_notes[j];
+		keys[num_keys++] = note->key;
+		if(j + 1 < my_level->num_cache_notes &&
+		   !note_compare(note, note + 1))
+			continue;
 		
-		nauty(new_graph->nauty_graph, lab, ptn, NULL, orbits,
-			  &options, &stats, workspace, 50 * m, m, new_graph->n, new_graph->gcan);
+		//without a canonical form or a parent to recompute it from,
+		//only the fingerprint is compared
+		graph_info probe;
+		probe.n = my_level->n;
+		probe.fingerprint = note->fingerprint;
+		probe.fingerprint_hi = note->fingerprint_hi;
+		probe.gcan = NULL;
+		probe.parent = NULL;
+		graph_info *g = graph_set_find(&my_level->sets[note->m -
+													   my_level->min_m],
+									   &probe);
+		if(g)
+			metrics_cache_add(my_level->cache, keys, num_keys, g);
+		num_keys = 0;
 	}
+	free(keys);
+	my_level->num_cache_notes = 0;
+	metrics_cache_flush(my_level->cache);
+}
 
-	if(!hash_set_add(my_level->sets[i], new_graph))
+bool add_graph_to_level(graph_info *new_graph, level *my_level)
+{
+	unsigned i = new_graph->m - my_level->min_m;
+	unsigned long score = graph_info_score(new_graph);
+	
+	if(level_rejects_score(my_level, new_graph->m, score))
+		return false;
+	
+	//Ties are broken by the canonical form, so we need it now
+	bool noted = my_level->cache && new_graph->cache_key_hi &&
+				 !new_graph->gcan &&
+				 !metrics_cache_lookup(my_level->cache, new_graph);
+	calc_gcan(new_graph);
+	
+	if(graph_queue_num_elems(&my_level->queues[i]) >= level_cap(my_level, i) &&
+	   graph_info_compare(new_graph,
+						  graph_queue_peek(&my_level->queues[i]).graph) > 0)
+		return false;
+
+	if(my_level->fingerprint_only)
+		dedupe_stats.expected_collisions +=
+			graph_set_size(&my_level->sets[i]) / 0x1p128;
+	bool added = graph_set_add(&my_level->sets[i], new_graph);
+	if(noted)
+		note_cached(my_level, new_graph);
+	if(!added)
 	{
 		//this graph already exists
+		if(my_level->fingerprint_only)
+			verify_duplicate(my_level, i, new_graph);
 		return false;
 	}
 	
+	if(my_level->fingerprint_only)
+	{
+		free(new_graph->gcan);
+		new_graph->gcan = NULL;
+	}
 	_add_graph_to_level(new_graph, my_level);
 	
 	return true;
 }
 
+//Moves all but the best hot_p / 2 graphs of queue i to disk
+static void spill_queue(level *my_level, unsigned i)
+{
+	graph_queue *queue = &my_level->queues[i];
+	unsigned num_spilled = graph_queue_num_elems(queue) - my_level->hot_p / 2;
+	graph_info **spilled = malloc(num_spilled * sizeof(graph_info*));
+	
+	//the queue gives us the worst graph first
+	for(unsigned j = num_spilled; j > 0; j--)
+	{
+		spilled[j - 1] = graph_queue_pull(queue).graph;
+		graph_set_remove(&my_level->sets[i], spilled[j - 1]);
+	}
+	
+	if(!spill_write_run(my_level->spills[i], spilled, num_spilled))
+		fprintf(stderr, "Error: couldn't spill graphs to disk\n");
+	
+	for(unsigned j = 0; j < num_spilled; j++)
+		graph_info_destroy(spilled[j]);
+	free(spilled);
+}
+
 //Doesn't check/add to hash set
-//Used for the first level created by geng
 void _add_graph_to_level(graph_info *new_graph, level *my_level)
 {
 	unsigned i = new_graph->m - my_level->min_m;
-	priority_queue_push(my_level->queues[i], new_graph);
-	if(priority_queue_num_elems(my_level->queues[i]) > my_level->p)
+	if(my_level->compact)
+		graph_info_compact(new_graph);
+	graph_queue_push(&my_level->queues[i], graph_entry_create(new_graph));
+	if(my_level->spills)
+	{
+		if(graph_queue_num_elems(&my_level->queues[i]) > my_level->hot_p)
+			spill_queue(my_level, i);
+	}
+	else if(graph_queue_num_elems(&my_level->queues[i]) >
+			level_cap(my_level, i))
 	{
-		graph_info *g = priority_queue_pull(my_level->queues[i]);
-		if(g->gcan)
-			hash_set_remove(my_level->sets[i], g);
+		graph_info *g = graph_queue_pull(&my_level->queues[i]).graph;
+		if(g->gcan || g->parent || my_level->fingerprint_only)
+			graph_set_remove(&my_level->sets[i], g);
 		graph_info_destroy(g);
 	}
+	
+	if(graph_queue_num_elems(&my_level->queues[i]) >= level_cap(my_level, i))
+		__atomic_store_n(&my_level->thresholds[i],
+						 graph_queue_peek(&my_level->queues[i]).score,
+						 __ATOMIC_RELAXED);
 }
 
-static void init_extended(graph_info input, graph_info *extended)
+//Mixes one graph's key into the running sum
+static bool checksum_visit(graph_info *g, void *data)
 {
-	extended->n = (input.n+1);
-	
-	int m = (input.n + WORDSIZE - 1) / WORDSIZE;
-	int extended_m = (input.n + WORDSIZE)/WORDSIZE;
-	
-	extended->nauty_graph = malloc(extended->n * extended_m * sizeof(setword));
-	
-	for(int i = 0; i < input.n; i++)
+	unsigned long *sum = data;
+	unsigned long h = g->fingerprint ^ g->fingerprint_hi * 0xff51afd7ed558ccdUL;
+	h ^= ((unsigned long) g->sum_of_distances << 32) ^
+		 ((unsigned long) g->diameter << 16) ^ g->m;
+	//mix so that the sum doesn't cancel out
+	h *= 0x9e3779b97f4a7c15UL;
+	*sum += h ^ (h >> 29);
+	return true;
+}
+
+//Order-independent hash of every graph in the level.
+//Two runs produced the same level iff (barring collisions) the checksums
+//match, regardless of the order graphs were generated in.
+unsigned long level_checksum(level *my_level)
+{
+	unsigned long ret = 0;
+	for(int i = 0; i < my_level->num_m; i++)
 	{
-		for(int j = 0; j < m; j++)
-			extended->nauty_graph[i*extended_m + j] = input.nauty_graph[i*m + j];
-		if(extended_m > m)
-			extended->nauty_graph[i*extended_m + m] = 0;
+		if(my_level->spills)
+		{
+			level_foreach(my_level, i, checksum_visit, &ret);
+			continue;
+		}
+		
+		//compact graphs have all it needs, so don't expand them
+		graph_queue *queue = &my_level->queues[i];
+		unsigned num_graphs = graph_queue_num_elems(queue);
+		graph_entry *entries = malloc(num_graphs * sizeof(graph_entry));
+		graph_queue_sorted(queue, entries);
+		for(unsigned j = 0; j < num_graphs; j++)
+			checksum_visit(entries[j].graph, &ret);
+		free(entries);
 	}
-	for(int i = 0; i < extended_m; i++)
-		extended->nauty_graph[input.n*extended_m + i] = 0;
-	
-	
+	return ret;
+}
+
+static void init_extended(graph_info input, graph_info *extended)
+{
+	extended->n = (input.n+1);
+	extended->nauty_graph = NULL;
 	extended->gcan = NULL;
 	
 	extended->distances = malloc(extended->n*extended->n*sizeof(*extended->distances));
@@ -183,101 +591,387 @@ static void init_extended(graph_info input, graph_info *extended)
 	extended->distances[extended->n*extended->n - 1] = 0;
 	
 	extended->k = (int*) malloc(extended->n*sizeof(int));
-	for(int i = 0; i < input.n; i++)
-		extended->k[i] = input.k[i];
+	memcpy(extended->k, input.k, input.n*sizeof(int));
 	extended->k[input.n] = 0;
 	
+	extended->adj = malloc(extended->n*MAX_K*sizeof(int));
+	memcpy(extended->adj, input.adj, input.n*MAX_K*sizeof(int));
+	
 	extended->m = input.m;
 	extended->max_k = input.max_k;
+	//for the children's keys in the cache
+	extended->fingerprint = input.fingerprint;
+	extended->fingerprint_hi = input.fingerprint_hi;
+	extended->cache_key = extended->cache_key_hi = 0;
+	extended->frozen_adj = NULL;
 }
 
 static void destroy_extended(graph_info extended)
 {
 	free(extended.distances);
-	free(extended.nauty_graph);
+	free(extended.adj);
 	free(extended.k);
 }
 
-static void add_edges(graph_info *g, unsigned start, int extended_m,
-					  level *my_level)
+//Steps c[0] < c[1] < ... < c[size-1] to the next size-subset of
+//{0, ..., num - 1} in colex order. Returns false after the last one.
+static bool next_combination(unsigned *c, unsigned size, unsigned num)
+{
+	unsigned j = 0;
+	while(j < size - 1 && c[j] + 1 == c[j + 1])
+		j++;
+	if(c[j] + 1 >= (j < size - 1 ? c[j + 1] : num))
+		return false;
+	c[j]++;
+	for(unsigned i = 0; i < j; i++)
+		c[i] = i;
+	return true;
+}
+
+//Canonical augmentation (McKay): a child is only kept if its new vertex
+//is in the same orbit as its canonical deletion vertex, so each
+//isomorphism class comes from a single parent (the child without that
+//vertex), however many parents in the beam could produce it.
+//The deletion vertex is picked among the vertices that don't disconnect
+//the graph, with the least invariant (degree, then the largest sum of
+//distances), and among those it's the one labelled last by nauty.
+//The invariant turns away most children before nauty is run.
+bool is_canonical_child(graph_info *g)
+{
+	int n = g->n, v = n - 1;
+	bool cut[n];
+	find_cut_vertices(g, cut);
+	
+	long invariant[n];
+	unsigned num_candidates = 0;
+	for(int u = 0; u < n; u++)
+	{
+		long sum = 0;
+		for(int i = 0; i < n; i++)
+			sum += g->distances[n*u + i];
+		invariant[u] = ((long) g->k[u] << 32) - sum;
+	}
+	for(int u = 0; u < n; u++)
+	{
+		if(cut[u])
+			continue;
+		if(invariant[u] < invariant[v])
+			return false;
+		if(invariant[u] == invariant[v])
+			num_candidates++;
+	}
+	if(num_candidates == 1)
+		return true;
+	
+	int lab[n], orbits[n];
+	calc_gcan_orbits(g, lab, orbits);
+	for(int i = n - 1; ; i--)
+	{
+		int u = lab[i];
+		if(!cut[u] && invariant[u] == invariant[v])
+			return orbits[u] == orbits[v];
+	}
+}
+
+//Creates the child of g where the new vertex (g->n - 1) is joined to
+//neighbours, which batch has just scored, and hands it to offer.
+//If keyed, g is labelled canonically, and the child gets its key in
+//the cache.
+static void add_child(graph_info *g, unsigned *neighbours, unsigned size,
+					  score_batch *batch, int sum_of_distances, int diameter,
+					  bool keyed, child_offer_func offer, void *data)
 {
-	//setup m and k[n] for the children
-	//note that these values will not change b/w each child
-	//of this node in the search tree
-	g->m++;
-	g->k[g->n - 1]++;
-	unsigned old_max_k = g->max_k;
-	if(g->k[g->n - 1] > g->max_k)
-		g->max_k = g->k[g->n - 1];
+	unsigned v = g->n - 1;
+	graph_info *child = new_graph_info(*g);
+	for(unsigned j = 0; j < size; j++)
+		graph_info_add_edge(child, neighbours[j], v);
+	child->new_degree = size;
+	if(keyed)
+		metrics_cache_key(g, neighbours, size, child);
 	
-	//if the child has a node of degree greater than MAX_K,
-	//don't search it
-	if(g->k[g->n - 1] <= my_level->max_k)
+	score_child_distances(batch, child->distances, child->n);
+	child->sum_of_distances = sum_of_distances;
+	child->diameter = diameter;
+	offer(child, data);
+}
+
+//Takes child, and adds it to the level (data) if it should be there
+static void offer_to_level(graph_info *child, void *data)
+{
+	level *my_level = data;
+	if((my_level->canonical_augmentation && !is_canonical_child(child)) ||
+	   !add_graph_to_level(child, my_level))
+		graph_info_destroy(child);
+}
+
+//Sorts the spare vertices of g (whose last vertex is new) so that the
+//most central ones come first: by eccentricity, then by sum of
+//distances to the other vertices. The new vertex's own distances,
+//1 + the distance to its nearest neighbour, make up most of a child's
+//score, so children of central vertices tend to be the best, and
+//trying them first makes the level reject the rest sooner.
+static void rank_spare(graph_info *g, unsigned *spare, unsigned num_spare)
+{
+	if(num_spare < 2)
+		return;
+	unsigned long priority[num_spare];
+	for(unsigned j = 0; j < num_spare; j++)
 	{
-		for(unsigned i = start; i < g->n - 1; i++)
+		int *row = g->distances + g->n * spare[j];
+		unsigned long eccentricity = 0, sum = 0;
+		for(int i = 0; i < g->n - 1; i++)
 		{
-			g->k[i]++;
-			
-			//same as comment above
-			if(g->k[i] <= my_level->max_k)
-			{
-				unsigned old_max_k = g->max_k;
-				if(g->k[i] > g->max_k)
-					g->max_k = g->k[i];
-				
-				g->distances[g->n*i + (g->n-1)] = g->distances[g->n*(g->n-1) + i] = 1;
-				ADDELEMENT(GRAPHROW(g->nauty_graph, i, extended_m), g->n-1);
-				ADDELEMENT(GRAPHROW(g->nauty_graph, g->n-1, extended_m), i);
-				
-				add_edges(g, i + 1, extended_m, my_level);
-				
-				DELELEMENT(GRAPHROW(g->nauty_graph, i, extended_m), g->n-1);
-				DELELEMENT(GRAPHROW(g->nauty_graph, g->n-1, extended_m), i);
-				g->distances[g->n*i + (g->n-1)] = g->distances[g->n*(g->n-1) + i] = GRAPH_INFINITY;
-				g->max_k = old_max_k;
-			}
-			g->k[i]--;
+			sum += row[i];
+			if(row[i] > eccentricity)
+				eccentricity = row[i];
 		}
+		priority[j] = eccentricity << 32 | sum;
 	}
 	
-	//tear down values we created in the beginning
-	g->max_k = old_max_k;
-	g->m--;
-	g->k[g->n - 1]--;
+	//insertion sort, lowest first (and lowest vertex on ties)
+	for(unsigned j = 1; j < num_spare; j++)
+	{
+		unsigned long p = priority[j];
+		unsigned v = spare[j], i = j;
+		for(; i > 0 && priority[i - 1] > p; i--)
+		{
+			priority[i] = priority[i - 1];
+			spare[i] = spare[i - 1];
+		}
+		priority[i] = p;
+		spare[i] = v;
+	}
+}
+
+//Offers every child of g (whose last vertex is new and isolated) for
+//my_level: one for each nonempty set of at most max_k neighbours for
+//the new vertex, among the vertices that can still take an edge.
+//Every child is scored first, and only built if the score could get
+//it into the level. Subsets of the most promising vertices (see
+//rank_spare()) come first.
+static void add_edges(graph_info *g, level *my_level, child_offer_func offer,
+					  void *data)
+{
+	unsigned spare[g->n - 1], num_spare = 0;
+	for(unsigned i = 0; i < g->n - 1; i++)
+		if(g->k[i] < my_level->max_k)
+			spare[num_spare++] = i;
+	rank_spare(g, spare, num_spare);
 	
+	score_batch batch;
+	if(!score_batch_init(&batch, g->distances, g->n - 1, g->n))
+		return;
 	
-	if(g->k[g->n - 1] > 0)
+	unsigned c[my_level->max_k], neighbours[my_level->max_k];
+	for(unsigned size = 1; size <= my_level->max_k && size <= num_spare; size++)
 	{
-		graph_info *temporary = new_graph_info(*g);
-		fill_dist_matrix(*temporary); 
-		temporary->diameter = calc_diameter(*temporary); 
-		temporary->sum_of_distances = calc_sum(*temporary); 
-		if(!add_graph_to_level(temporary, my_level))
-			graph_info_destroy(temporary);
+		for(unsigned i = 0; i < size; i++)
+			c[i] = i;
+		do
+		{
+			for(unsigned j = 0; j < size; j++)
+				neighbours[j] = spare[c[j]];
+			
+			graph_info child;
+			score_child(&batch, neighbours, size, &child.sum_of_distances,
+						&child.diameter);
+			if(!level_rejects_score(my_level, g->m + size,
+									graph_info_score(&child)))
+				add_child(g, neighbours, size, &batch, child.sum_of_distances,
+						  child.diameter, my_level->cache != NULL, offer, data);
+		}
+		while(next_combination(c, size, num_spare));
 	}
+	
+	score_batch_fini(&batch);
 }
 
-void extend_graph_and_add_to_level(graph_info input, level *new_level)
+//Hands each child of input that could get into new_level to offer,
+//which takes ownership of it. Only reads new_level's thresholds (see
+//level_rejects_score()), so it can run alongside whatever adds to it.
+void extend_graph(graph_info *input, level *new_level, child_offer_func offer,
+				  void *data)
 {
 	graph_info extended;
-	init_extended(input, &extended);
+	init_extended(*input, &extended);
+	//the children copy it
+	extended.parent = new_level->delta ? input : NULL;
 	
-	add_edges(&extended, 0, (extended.n + WORDSIZE - 1) / WORDSIZE, new_level);
+	add_edges(&extended, new_level, offer, data);
 	
 	destroy_extended(extended);
 }
 
-void level_extend(level *old, level *new)
+void extend_graph_and_add_to_level(graph_info *input, level *new_level)
+{
+	extend_graph(input, new_level, offer_to_level, new_level);
+}
+
+static bool extend_visit(graph_info *g, void *data)
 {
-	for(int i = 0; i < old->num_m; i++)
+	extend_graph_and_add_to_level(g, data);
+	return true;
+}
+
+//Lower bound on the sum of distances of any child of a graph with n
+//vertices, m edges, this sum of distances and a diameter of at most
+//max_diameter.
+//Joining the new vertex v to S only adds paths i - a - v - b - j for
+//a, b in S, and these have length at least
+//  2 + D[i][a] + D[b][j] >= D[i][j] - D[a][b] + 2
+//so pairs of old vertices get at most max_diameter - 2 closer, and no
+//pair of nonadjacent vertices gets closer than 2. v itself is at least
+//as far from the old vertices as if they made a tree of degree max_k.
+static unsigned long child_sum_bound(unsigned n, unsigned m, unsigned sum,
+									 unsigned max_diameter, unsigned max_k)
+{
+	unsigned long pairs = n * (n - 1) / 2;
+	unsigned long old = m + 2 * (pairs - m);
+	unsigned long shortcut = max_diameter > 2 ? max_diameter - 2 : 0;
+	if(sum > shortcut * (pairs - m) + old)
+		old = sum - shortcut * (pairs - m);
+	
+	unsigned long from_v = 0;
+	unsigned left = n, width = max_k;
+	for(unsigned d = 1; left > 0; d++)
 	{
-		while(priority_queue_num_elems(old->queues[i]))
+		unsigned num = left < width ? left : width;
+		from_v += d * num;
+		left -= num;
+		width *= max_k - 1;
+	}
+	return old + from_v;
+}
+
+//True if no child of a graph in bucket i of old with this sum of
+//distances can get into new any more
+bool level_children_rejected(level *old, unsigned i, unsigned sum,
+							  unsigned max_diameter, level *new)
+{
+	unsigned m = i + old->min_m;
+	unsigned long bound = child_sum_bound(old->n, m, sum, max_diameter,
+										  old->max_k);
+	for(unsigned size = 1; size <= old->max_k; size++)
+	{
+		unsigned child_m = m + size;
+		if(child_m - new->min_m < new->num_m &&
+		   !level_rejects_score(new, child_m, bound << 32))
+			return false;
+	}
+	return true;
+}
+
+typedef struct {
+	level *old, *new;
+	unsigned i, max_diameter;
+	bool done;
+	unsigned long skipped;
+} extend_state;
+
+static bool extend_bucket_visit(graph_info *g, void *data)
+{
+	extend_state *state = data;
+	if(!state->done)
+		state->done = level_children_rejected(state->old, state->i,
+										g->sum_of_distances,
+										state->max_diameter, state->new);
+	if(state->done)
+		state->skipped++;
+	else
+		extend_graph_and_add_to_level(g, state->new);
+	return true;
+}
+
+static int parent_compare(const void *elem1, const void *elem2)
+{
+	return graph_info_compare(((parent_ref*)elem1)->graph,
+							  ((parent_ref*)elem2)->graph);
+}
+
+//Returns the in-memory graphs of old, best first across all m, in
+//*parents (to be freed), and the largest diameter in each bucket.
+//Parents within a bucket come in order of sum of distances, so
+//bounding all of them with the largest diameter in the bucket keeps
+//the bound of level_children_rejected() monotone. Spilled graphs
+//aren't counted, so fall back to the largest possible diameter.
+unsigned level_sorted_parents(level *old, parent_ref **parents_ret,
+							  unsigned *max_diameter)
+{
+	unsigned num_parents = 0;
+	for(unsigned i = 0; i < old->num_m; i++)
+		num_parents += graph_queue_num_elems(&old->queues[i]);
+	graph_entry *entries = malloc(num_parents * sizeof(graph_entry));
+	parent_ref *parents = malloc(num_parents * sizeof(parent_ref));
+	num_parents = 0;
+	for(unsigned i = 0; i < old->num_m; i++)
+	{
+		graph_queue *queue = &old->queues[i];
+		graph_queue_sorted(queue, entries);
+		max_diameter[i] = old->spills ? old->n - 1 : 0;
+		for(unsigned j = 0; j < graph_queue_num_elems(queue); j++)
 		{
-			graph_info *g = priority_queue_pull(old->queues[i]);
-			extend_graph_and_add_to_level(*g, new);
-			graph_info_destroy(g);
+			graph_info *g = entries[j].graph;
+			if(g->diameter > max_diameter[i])
+				max_diameter[i] = g->diameter;
+			parents[num_parents].graph = g;
+			parents[num_parents++].i = i;
 		}
 	}
+	free(entries);
+	
+	//each bucket is in order already, but they're interleaved
+	qsort(parents, num_parents, sizeof(parent_ref), parent_compare);
+	*parents_ret = parents;
+	return num_parents;
+}
+
+//Extends the graphs of old best first across all m, so that the
+//buckets of new fill up with good graphs (and start rejecting children
+//by score) as early as possible. Once child_sum_bound() says that no
+//child of a parent can get into new, the rest of the parent's bucket
+//is worse and gets skipped.
+//Returns the number of parents that were skipped.
+unsigned long level_extend(level *old, level *new)
+{
+	unsigned max_diameter[old->num_m];
+	parent_ref *parents;
+	unsigned num_parents = level_sorted_parents(old, &parents, max_diameter);
+	
+	//The spilled parts of buckets can only be read in order, bucket
+	//by bucket
+	if(old->spills)
+	{
+		unsigned long skipped = 0;
+		for(unsigned i = 0; i < old->num_m; i++)
+		{
+			extend_state state = {old, new, i, max_diameter[i], false, 0};
+			level_foreach(old, i, extend_bucket_visit, &state);
+			skipped += state.skipped;
+		}
+		free(parents);
+		return skipped;
+	}
+	
+	bool done[old->num_m];
+	for(unsigned i = 0; i < old->num_m; i++)
+		done[i] = false;
+	unsigned long skipped = 0;
+	visit_state state = {extend_visit, new};
+	for(unsigned j = 0; j < num_parents; j++)
+	{
+		graph_info *g = parents[j].graph;
+		unsigned i = parents[j].i;
+		if(!done[i])
+			done[i] = level_children_rejected(old, i, g->sum_of_distances,
+										max_diameter[i], new);
+		if(done[i])
+			skipped++;
+		else
+			materialize_visit(g, &state);
+	}
+	
+	free(parents);
+	return skipped;
 }
 
 void test_extend_graph(void)
@@ -290,21 +984,18 @@ void test_extend_graph(void)
 		2, 1, 3, 0, 4,
 		2, 3, 1, 4, 0,
 	};
-	int m = (4 + WORDSIZE) / WORDSIZE;
-	graph nauty_graph[m * 5];
-	for (int i = 0; i < m * 5; i++)
-		nauty_graph[i] = 0;
-	ADDELEMENT(GRAPHROW(nauty_graph, 0, m), 1);
-	ADDELEMENT(GRAPHROW(nauty_graph, 0, m), 2);
-	ADDELEMENT(GRAPHROW(nauty_graph, 1, m), 0);
-	ADDELEMENT(GRAPHROW(nauty_graph, 1, m), 3);
-	ADDELEMENT(GRAPHROW(nauty_graph, 2, m), 0);
-	ADDELEMENT(GRAPHROW(nauty_graph, 2, m), 4);
-	ADDELEMENT(GRAPHROW(nauty_graph, 3, m), 1);
-	ADDELEMENT(GRAPHROW(nauty_graph, 4, m), 2);
+	int adj[5 * MAX_K] = {
+		1, 2, 0,
+		0, 3, 0,
+		0, 4, 0,
+		1, 0, 0,
+		2, 0, 0,
+	};
 	
 	g.distances = distances;
-	g.nauty_graph = nauty_graph;
+	g.adj = adj;
+	g.nauty_graph = NULL;
+	g.gcan = NULL;
 	g.n = 5;
 	int g_k[5] = {2, 2, 2, 1 ,1};
 	g.k = g_k;
@@ -315,7 +1006,7 @@ void test_extend_graph(void)
 	
 	level *my_level = level_create(6, 1000, 3);
 	
-	extend_graph_and_add_to_level(g, my_level);
+	extend_graph_and_add_to_level(&g, my_level);
 	
 	level_empty_and_print(my_level);
 	
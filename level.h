@@ -4,7 +4,72 @@
 #include "graph.h"
 #include "hash_set.h"
 #include "priority_queue.h"
+#include "spill.h"
+#include "cache.h"
 
+//Beam entries carry their sort key inline, so sifting only touches
+//the graph itself on a fingerprint collision
+typedef struct {
+	unsigned long score; //see graph_info_score()
+	unsigned long fingerprint;
+	graph_info *graph;
+} graph_entry;
+
+static inline graph_entry graph_entry_create(graph_info *g)
+{
+	graph_entry ret = {graph_info_score(g), g->fingerprint, g};
+	return ret;
+}
+
+//Same order as graph_info_compare()
+static inline bool graph_entry_compare_gt(graph_entry e1, graph_entry e2)
+{
+	if(e1.score != e2.score)
+		return e1.score > e2.score;
+	if(e1.fingerprint != e2.fingerprint)
+		return e1.fingerprint > e2.fingerprint;
+	return graph_info_compare(e1.graph, e2.graph) > 0;
+}
+
+//Sums of distances in a beam bucket only span a small range, so the
+//beam is a bucket queue on the sum, with a small heap per sum ordered
+//by graph_entry_compare_gt() (diameter, then the canonical form)
+static inline unsigned long graph_entry_sum(graph_entry e)
+{
+	return e.score >> 32;
+}
+
+DEFINE_BUCKET_QUEUE(graph_queue, graph_entry, graph_entry_sum,
+					graph_entry_compare_gt)
+
+//Hash set of canonical forms
+
+static inline unsigned long graph_set_hash(graph_info *g)
+{
+	return g->fingerprint;
+}
+
+//The hashes match already, so check the rest of the fingerprint first
+static inline bool graph_set_equal(graph_info *g1, graph_info *g2)
+{
+	return g1->n == g2->n && g1->fingerprint_hi == g2->fingerprint_hi &&
+		   !graph_info_compare_gcan(g1, g2);
+}
+
+DEFINE_HASH_SET(graph_set, graph_info*, graph_set_hash, graph_set_equal)
+
+//A child that was canonicalized, under the key it had in the cache
+typedef struct {
+	cache_key key;
+	unsigned long fingerprint, fingerprint_hi;
+	unsigned m;
+} cache_note;
+
+//Each m keeps the best p graphs under graph_info_compare(), which is a
+//total order, so the contents of a level only depend on the set of
+//graphs offered to it and never on the order they arrive in.
+//Any alternative way of generating a level (reordered, parallel, ...)
+//must produce the same level_checksum() as the serial level_extend().
 typedef struct {
 	unsigned min_m; // minimum m (n - 1)
 	unsigned num_m; // number of possible values of m
@@ -12,17 +77,105 @@ typedef struct {
 	unsigned p;
 	unsigned max_k;
 	
-	hash_set **sets; //one hash set for each m
-	priority_queue **queues;
+	graph_set *sets; //one hash set for each m
+	graph_queue *queues; //worst graph on top
+	//score of the worst graph in each full queue, ULONG_MAX otherwise;
+	//read and written atomically, so that children can be scored
+	//against it while other threads add to the level
+	unsigned long *thresholds;
+	
+	//Only used when spilling to disk (see level_set_spill()):
+	//each queue holds at most hot_p graphs, and the rest are in spills
+	unsigned hot_p;
+	spill **spills;
+	
+	//Keep only the canonical form and score of each graph (see
+	//graph_info_compact()), and recompute the rest when it's extended
+	bool compact;
+	
+	//If set, children are looked up here (see graph_info.cache_key)
+	//before they're canonicalized, and those that miss are noted if
+	//they make it into the level, or are already there, so that
+	//level_record_cache() can add the ones that are still there at
+	//the end. Parents have to be labelled canonically, so the graphs
+	//must be compact.
+	metrics_cache *cache;
+	cache_note *cache_notes;
+	unsigned num_cache_notes, cache_notes_capacity;
+	
+	//Only take children by canonical augmentation (see
+	//is_canonical_child()), so that each isomorphism class is built from
+	//one parent at most
+	bool canonical_augmentation;
+	
+	//Children only point to their parent in the previous level (see
+	//graph_info.parent), so with compact set a graph in the level is
+	//little more than its score and fingerprint. Its canonical form is
+	//recomputed only when another graph's fingerprint matches. The
+	//previous level's parents have to outlive it (see level_freeze()).
+	bool delta;
+	
+	//Only used when the level is split across processes (see shard.h):
+	//thresholds points into shared memory, and a score is rejected if any
+	//shard's thresholds reject it
+	unsigned num_shards;
+	unsigned long **shard_thresholds;
+	
+	//Drop the canonical form of each graph once it's in, and tell graphs
+	//apart by their 128-bit fingerprint alone. Every verify_every-th
+	//duplicate (if not 0) gets both canonical forms compared anyway.
+	bool fingerprint_only;
+	unsigned verify_every;
+	
+	//If set, bucket i keeps the best caps[i] graphs instead of p (see
+	//level_allocate())
+	unsigned *caps;
+	//Set by level_allocate(): the number of graphs in each bucket of the
+	//level this one was built from
+	unsigned *num_parents;
 } level;
 
+static inline unsigned level_cap(level *my_level, unsigned i)
+{
+	return my_level->caps ? my_level->caps[i] : my_level->p;
+}
+
+//Takes ownership of a child that extend_graph() produced
+typedef void (*child_offer_func)(graph_info *child, void *data);
+
+//A parent and its bucket
+typedef struct {
+	graph_info *graph;
+	unsigned i;
+} parent_ref;
+
 level *level_create(unsigned n, unsigned p, unsigned max_k);
 void level_delete(level *my_level);
+bool level_set_spill(level *my_level, unsigned hot_p, const char *dir);
+void level_share_thresholds(level *my_level, unsigned long **shard_thresholds,
+							unsigned num_shards, unsigned self);
+void level_truncate(level *my_level, unsigned i, unsigned keep);
+void level_allocate(level *old, level *new, unsigned max_n);
+unsigned level_freeze(level *old, level *new, graph_info ***frozen_ret);
+void level_frozen_delete(graph_info **frozen, unsigned num_frozen);
+void level_foreach(level *my_level, unsigned i, graph_visit_func func,
+				   void *data);
 void level_empty_and_print(level *my_level);
-void level_extend(level *old, level *new);
-void extend_graph_and_add_to_level(graph_info input, level *new_level);
+unsigned long level_extend(level *old, level *new);
+void extend_graph(graph_info *input, level *new_level, child_offer_func offer,
+				  void *data);
+void extend_graph_and_add_to_level(graph_info *input, level *new_level);
+bool is_canonical_child(graph_info *g);
+unsigned level_sorted_parents(level *old, parent_ref **parents_ret,
+							  unsigned *max_diameter);
+bool level_children_rejected(level *old, unsigned i, unsigned sum,
+							 unsigned max_diameter, level *new);
+bool level_rejects_score(level *my_level, unsigned m, unsigned long score);
 bool add_graph_to_level(graph_info *new_graph, level *my_level);
 void _add_graph_to_level(graph_info *new_graph, level *my_level);
+unsigned long level_checksum(level *my_level);
+void level_record_cache(level *my_level);
+void level_print_dedupe_stats(void);
 void test_extend_graph(void);
 
 
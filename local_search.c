@@ -0,0 +1,600 @@
+#define _POSIX_C_SOURCE 200809L
+#include "local_search.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+	graph_info *g, *best;
+	unsigned max_k;
+	unsigned long random; //xorshift state, never 0
+	unsigned long num_moves;
+	unsigned long tried, taken, added;
+	double seconds; //of CPU time, for the moves
+
+	//the edges removed by the last switches
+	int tabu[LOCAL_SEARCH_TABU][2];
+	unsigned tabu_next;
+
+	//scratch space for repair_row()
+	bool *lost, *queued;
+	int *candidates, *lost_list, *queued_list, *counts;
+	//the distances repair_row() changed in the current move, and what
+	//they were before, to undo it
+	int **undo_at, *undo_was;
+
+	pthread_t thread;
+} chain;
+
+static unsigned long next_random(unsigned long *state)
+{
+	unsigned long x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545f4914f6cdd1dUL;
+}
+
+static bool adjacent(graph_info *g, int i, int j)
+{
+	for(int slot = 0; slot < g->k[i]; slot++)
+		if(ADJ(g, i)[slot] == j)
+			return true;
+	return false;
+}
+
+static bool is_tabu(chain *c, int i, int j)
+{
+	for(unsigned t = 0; t < LOCAL_SEARCH_TABU; t++)
+		if((c->tabu[t][0] == i && c->tabu[t][1] == j) ||
+		   (c->tabu[t][0] == j && c->tabu[t][1] == i))
+			return true;
+	return false;
+}
+
+static void make_tabu(chain *c, int i, int j)
+{
+	c->tabu[c->tabu_next][0] = i;
+	c->tabu[c->tabu_next][1] = j;
+	c->tabu_next = (c->tabu_next + 1) % LOCAL_SEARCH_TABU;
+}
+
+static void keep_if_best(chain *c)
+{
+	if(graph_info_score(c->g) >= graph_info_score(c->best))
+		return;
+	graph_info_destroy(c->best);
+	c->best = new_graph_info(*c->g);
+}
+
+//Sum of distances once uv is added: a path can only get shorter by
+//going through the new edge once
+static int sum_with_edge(graph_info *g, int u, int v)
+{
+	int n = g->n, sum = 0;
+	int *du = g->distances + n * u, *dv = g->distances + n * v;
+	for(int i = 0; i < n; i++)
+	{
+		int *row = g->distances + n * i;
+		for(int j = i + 1; j < n; j++)
+		{
+			int d = row[j];
+			if(du[i] + 1 + dv[j] < d)
+				d = du[i] + 1 + dv[j];
+			if(dv[i] + 1 + du[j] < d)
+				d = dv[i] + 1 + du[j];
+			sum += d;
+		}
+	}
+	return sum;
+}
+
+//Brings g's distances, sum of distances and diameter up to date after
+//uv has been added, in one pass over the pairs
+static void add_edge_distances(graph_info *g, int u, int v)
+{
+	int n = g->n, sum = 0, diameter = 0;
+	int du[n], dv[n];
+	memcpy(du, g->distances + n * u, n * sizeof(int));
+	memcpy(dv, g->distances + n * v, n * sizeof(int));
+	for(int i = 0; i < n; i++)
+	{
+		int *row = g->distances + n * i;
+		for(int j = i + 1; j < n; j++)
+		{
+			int d = row[j];
+			if(du[i] + 1 + dv[j] < d)
+				d = du[i] + 1 + dv[j];
+			if(dv[i] + 1 + du[j] < d)
+				d = dv[i] + 1 + du[j];
+			row[j] = g->distances[n * j + i] = d;
+			sum += d;
+			if(d > diameter)
+				diameter = d;
+		}
+	}
+	g->sum_of_distances = sum;
+	g->diameter = diameter;
+}
+
+//Sum of distances and diameter once both ac and bd are added, in one
+//pass over the pairs. A shortest path takes bd at most once, and the
+//parts before and after it only need the distances with ac added, which
+//only have to be worked out beforehand from b and d. If apply is set,
+//g's distances are brought up to date too.
+static void switch_distances(graph_info *g, int a, int c, int b, int d,
+							 bool apply, int *sum_ret, int *diameter_ret)
+{
+	int n = g->n, sum = 0, diameter = 0;
+	int da[n], dc[n], db[n], dd[n];
+	memcpy(da, g->distances + n * a, n * sizeof(int));
+	memcpy(dc, g->distances + n * c, n * sizeof(int));
+	for(int i = 0; i < n; i++)
+	{
+		db[i] = g->distances[n * b + i];
+		if(da[b] + 1 + dc[i] < db[i])
+			db[i] = da[b] + 1 + dc[i];
+		if(dc[b] + 1 + da[i] < db[i])
+			db[i] = dc[b] + 1 + da[i];
+		dd[i] = g->distances[n * d + i];
+		if(da[d] + 1 + dc[i] < dd[i])
+			dd[i] = da[d] + 1 + dc[i];
+		if(dc[d] + 1 + da[i] < dd[i])
+			dd[i] = dc[d] + 1 + da[i];
+	}
+	for(int i = 0; i < n; i++)
+	{
+		int *row = g->distances + n * i;
+		for(int j = i + 1; j < n; j++)
+		{
+			int dist = row[j];
+			if(da[i] + 1 + dc[j] < dist)
+				dist = da[i] + 1 + dc[j];
+			if(dc[i] + 1 + da[j] < dist)
+				dist = dc[i] + 1 + da[j];
+			if(db[i] + 1 + dd[j] < dist)
+				dist = db[i] + 1 + dd[j];
+			if(dd[i] + 1 + db[j] < dist)
+				dist = dd[i] + 1 + db[j];
+			if(apply)
+				row[j] = g->distances[n * j + i] = dist;
+			sum += dist;
+			if(dist > diameter)
+				diameter = dist;
+		}
+	}
+	*sum_ret = sum;
+	*diameter_ret = diameter;
+}
+
+//Adds the edge with the smallest resulting sum of distances between
+//vertices with spare degree, for as long as there is one
+static void add_spare_edges(chain *c)
+{
+	graph_info *g = c->g;
+	int n = g->n;
+	while(true)
+	{
+		int spare[n], num_spare = 0;
+		for(int i = 0; i < n; i++)
+			if(g->k[i] < c->max_k)
+				spare[num_spare++] = i;
+
+		int best_u = -1, best_v = -1, best_sum = 0;
+		for(int x = 0; x < num_spare; x++)
+			for(int y = x + 1; y < num_spare; y++)
+			{
+				int u = spare[x], v = spare[y];
+				if(adjacent(g, u, v))
+					continue;
+				int sum = sum_with_edge(g, u, v);
+				if(best_u < 0 || sum < best_sum)
+				{
+					best_u = u;
+					best_v = v;
+					best_sum = sum;
+				}
+			}
+		if(best_u < 0)
+			return;
+
+		graph_info_add_edge(g, best_u, best_v);
+		add_edge_distances(g, best_u, best_v);
+		c->added++;
+		keep_if_best(c);
+	}
+}
+
+//Scratch space for repair_row(), with lost, queued and counts all
+//false (0) between calls, and where it logs what it changes
+typedef struct {
+	int n;
+	const int *k, *adj;
+	bool *lost, *queued;
+	int *candidates, *lost_list, *queued_list, *counts;
+	int **undo_at, *undo_was;
+	unsigned num_undo;
+} repair_state;
+
+//True if x still has a neighbour one step closer to the source of row
+//that hasn't moved away from it
+static inline bool has_parent(repair_state *r, const int *row, int x)
+{
+	for(int j = 0; j < r->k[x]; j++)
+	{
+		int w = r->adj[MAX_K * x + j];
+		if(row[w] == row[x] - 1 && !r->lost[w])
+			return true;
+	}
+	return false;
+}
+
+//Sorts list (of num vertices) by their distance in row, with
+//unreachable vertices last, into sorted
+static void sort_by_distance(repair_state *r, const int *row, const int *list,
+							 int num, int *sorted)
+{
+	int n = r->n;
+	for(int j = 0; j < num; j++)
+		r->counts[row[list[j]] < n ? row[list[j]] : n]++;
+	for(int d = 1; d <= n; d++)
+		r->counts[d] += r->counts[d - 1];
+	for(int j = num - 1; j >= 0; j--)
+	{
+		int d = row[list[j]] < n ? row[list[j]] : n;
+		sorted[--r->counts[d]] = list[j];
+	}
+	memset(r->counts, 0, (n + 1) * sizeof(int));
+}
+
+//Fixes the distances from the source of row once the edges in removed
+//(num_removed pairs) are gone from the graph, which can only move
+//vertices away. A vertex moves away iff every neighbour one step closer
+//has, so those are found layer by layer from the removed edges' far
+//ends, and in a graph this close to a tree they're usually only a
+//handful. They then get their distances from the rest by a BFS that
+//starts each of them at its own distance.
+//Both walks take vertices in order of distance by merging a sorted
+//list with a FIFO, which only ever gets vertices one step further than
+//the one taken, so besides the counting sort of the lost vertices
+//(O(n)) they take time linear in the vertices they visit.
+//Returns false if some of them can't be reached any more.
+static bool repair_row(repair_state *r, int *row, int removed[][2],
+					   unsigned num_removed)
+{
+	int num_seeds = 0, num_lost = 0, num_queued = 0;
+	int seeds[num_removed];
+	for(unsigned e = 0; e < num_removed; e++)
+	{
+		int x = removed[e][0], y = removed[e][1];
+		int far = row[x] > row[y] ? x : y;
+		if(row[x] != row[y] && !r->queued[far] && !has_parent(r, row, far))
+		{
+			r->queued[far] = true;
+			r->queued_list[num_queued++] = far;
+			int j = num_seeds++;
+			for(; j > 0 && row[seeds[j - 1]] > row[far]; j--)
+				seeds[j] = seeds[j - 1];
+			seeds[j] = far;
+		}
+	}
+
+	//a vertex is only decided once the layer before it has been
+	int next = 0, head = 0, tail = 0;
+	while(next < num_seeds || head < tail)
+	{
+		int x;
+		if(head == tail || (next < num_seeds &&
+							row[seeds[next]] <= row[r->candidates[head]]))
+			x = seeds[next++];
+		else
+			x = r->candidates[head++];
+		if(has_parent(r, row, x))
+			continue;
+		r->lost[x] = true;
+		r->lost_list[num_lost++] = x;
+		for(int j = 0; j < r->k[x]; j++)
+		{
+			int y = r->adj[MAX_K * x + j];
+			if(row[y] == row[x] + 1 && !r->queued[y])
+			{
+				r->queued[y] = true;
+				r->queued_list[num_queued++] = y;
+				r->candidates[tail++] = y;
+			}
+		}
+	}
+	for(int j = 0; j < num_queued; j++)
+		r->queued[r->queued_list[j]] = false;
+	if(!num_lost)
+		return true;
+
+	//the rest keep their distances
+	for(int j = 0; j < num_lost; j++)
+	{
+		int x = r->lost_list[j], d = GRAPH_INFINITY;
+		r->undo_at[r->num_undo] = &row[x];
+		r->undo_was[r->num_undo++] = row[x];
+		for(int i = 0; i < r->k[x]; i++)
+		{
+			int w = r->adj[MAX_K * x + i];
+			if(!r->lost[w] && row[w] + 1 < d)
+				d = row[w] + 1;
+		}
+		row[x] = d;
+	}
+
+	//a vertex that gets closer through another is in the FIFO as well,
+	//and is taken from there first
+	int *sorted = r->candidates, *fifo = r->queued_list;
+	sort_by_distance(r, row, r->lost_list, num_lost, sorted);
+	bool connected = true;
+	next = head = tail = 0;
+	while(next < num_lost || head < tail)
+	{
+		int x;
+		if(head == tail || (next < num_lost &&
+							row[sorted[next]] <= row[fifo[head]]))
+			x = sorted[next++];
+		else
+			x = fifo[head++];
+		if(!r->lost[x])
+			continue;
+		r->lost[x] = false;
+		if(row[x] >= GRAPH_INFINITY)
+			connected = false;
+		for(int i = 0; i < r->k[x]; i++)
+		{
+			int w = r->adj[MAX_K * x + i];
+			if(r->lost[w] && row[x] + 1 < row[w])
+			{
+				row[w] = row[x] + 1;
+				fifo[tail++] = w;
+			}
+		}
+	}
+	return connected;
+}
+
+//Tries one random switch ab, cd -> ac, bd, and keeps it unless it
+//disconnects the graph or makes the score worse
+static bool try_switch(chain *c)
+{
+	graph_info *g = c->g;
+	int n = g->n;
+	int a = next_random(&c->random) % n, cc = next_random(&c->random) % n;
+	if(!g->k[a] || !g->k[cc])
+		return false;
+	int b = ADJ(g, a)[next_random(&c->random) % g->k[a]];
+	int d = ADJ(g, cc)[next_random(&c->random) % g->k[cc]];
+	if(a == cc || a == d || b == cc || b == d || adjacent(g, a, cc) ||
+	   adjacent(g, b, d) || is_tabu(c, a, cc) || is_tabu(c, b, d))
+		return false;
+	c->tried++;
+
+	unsigned long old_score = graph_info_score(g);
+	int old_sum = g->sum_of_distances, old_diameter = g->diameter;
+
+	//Each row is repaired on its own, reading only itself, so the
+	//matrix stays symmetric without copying anything across. The new
+	//edges are only scored at first, so undoing the move only takes
+	//undoing the repairs.
+	int removed[2][2] = {{a, b}, {cc, d}};
+	graph_info_remove_edge(g, a, b);
+	graph_info_remove_edge(g, cc, d);
+	repair_state r = {n, g->k, g->adj, c->lost, c->queued, c->candidates,
+					  c->lost_list, c->queued_list, c->counts, c->undo_at,
+					  c->undo_was, 0};
+	bool connected = true;
+	for(int s = 0; connected && s < n; s++)
+		connected = repair_row(&r, g->distances + n * s, removed, 2);
+	graph_info_add_edge(g, a, cc);
+	graph_info_add_edge(g, b, d);
+	if(connected)
+		switch_distances(g, a, cc, b, d, false, &g->sum_of_distances,
+						 &g->diameter);
+	if(!connected || graph_info_score(g) > old_score)
+	{
+		graph_info_remove_edge(g, a, cc);
+		graph_info_remove_edge(g, b, d);
+		graph_info_add_edge(g, a, b);
+		graph_info_add_edge(g, cc, d);
+		for(unsigned j = 0; j < r.num_undo; j++)
+			*r.undo_at[j] = r.undo_was[j];
+		g->sum_of_distances = old_sum;
+		g->diameter = old_diameter;
+		return false;
+	}
+	switch_distances(g, a, cc, b, d, true, &g->sum_of_distances,
+					 &g->diameter);
+
+	c->taken++;
+	make_tabu(c, a, b);
+	make_tabu(c, cc, d);
+	keep_if_best(c);
+	return true;
+}
+
+static void *chain_main(void *data)
+{
+	chain *c = data;
+	struct timespec start, end;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	add_spare_edges(c);
+	for(unsigned long j = 0; j < c->num_moves; j++)
+		if(try_switch(c))
+			add_spare_edges(c); //spare vertices may have come apart
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	c->seconds = (end.tv_sec - start.tv_sec) +
+				 (end.tv_nsec - start.tv_nsec) / 1e9;
+	return NULL;
+}
+
+//A copy of g that a chain can change: expanded, and without a
+//canonical form or parent
+static graph_info *seed_copy(graph_info *g)
+{
+	bool compact = !g->distances;
+	if(compact)
+		graph_info_expand(g);
+	graph_info *ret = new_graph_info(*g);
+	if(compact)
+		graph_info_compact(g);
+	free(ret->gcan);
+	ret->gcan = NULL;
+	ret->fingerprint = ret->fingerprint_hi = 0;
+	ret->parent = NULL;
+	ret->frozen_adj = NULL;
+	ret->new_degree = 0;
+	ret->cache_key = ret->cache_key_hi = 0;
+	return ret;
+}
+
+static void chain_init(chain *c, graph_info *seed, unsigned max_k,
+					   unsigned index, unsigned long num_moves)
+{
+	memset(c, 0, sizeof(chain));
+	c->g = seed_copy(seed);
+	c->best = new_graph_info(*c->g);
+	c->max_k = max_k;
+	c->random = 0x9e3779b97f4a7c15UL * (index + 1);
+	c->num_moves = num_moves;
+	for(unsigned t = 0; t < LOCAL_SEARCH_TABU; t++)
+		c->tabu[t][0] = c->tabu[t][1] = -1;
+	c->lost = calloc(c->g->n, sizeof(bool));
+	c->queued = calloc(c->g->n, sizeof(bool));
+	c->candidates = malloc(c->g->n * sizeof(int));
+	c->lost_list = malloc(c->g->n * sizeof(int));
+	c->queued_list = malloc(c->g->n * sizeof(int));
+	c->counts = calloc(c->g->n + 1, sizeof(int));
+	//every distance changes at most once in a move
+	c->undo_at = malloc(c->g->n * c->g->n * sizeof(int*));
+	c->undo_was = malloc(c->g->n * c->g->n * sizeof(int));
+}
+
+static void chain_fini(chain *c)
+{
+	graph_info_destroy(c->g);
+	free(c->lost);
+	free(c->queued);
+	free(c->candidates);
+	free(c->lost_list);
+	free(c->queued_list);
+	free(c->counts);
+	free(c->undo_at);
+	free(c->undo_was);
+}
+
+//Runs a chain from each of the best num_chains graphs of my_level
+//(across all m), and returns the best graph any of them found, or
+//NULL if the level is empty
+graph_info *local_search(level *my_level, unsigned num_chains,
+						 unsigned long num_moves)
+{
+	unsigned max_diameter[my_level->num_m];
+	parent_ref *parents;
+	unsigned num_parents = level_sorted_parents(my_level, &parents,
+												max_diameter);
+	if(!num_parents)
+	{
+		free(parents);
+		return NULL;
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	chain *chains = malloc(num_chains * sizeof(chain));
+	for(unsigned j = 0; j < num_chains; j++)
+		chain_init(&chains[j], parents[j % num_parents].graph,
+				   my_level->max_k, j, num_moves);
+	int seed_sum = parents[0].graph->sum_of_distances;
+	free(parents);
+
+	for(unsigned j = 0; j < num_chains; j++)
+		pthread_create(&chains[j].thread, NULL, chain_main, &chains[j]);
+
+	graph_info *best = NULL;
+	unsigned long tried = 0, taken = 0, added = 0;
+	double cpu_seconds = 0;
+	for(unsigned j = 0; j < num_chains; j++)
+	{
+		chain *c = &chains[j];
+		pthread_join(c->thread, NULL);
+		tried += c->tried;
+		taken += c->taken;
+		added += c->added;
+		cpu_seconds += c->seconds;
+		if(!best || graph_info_score(c->best) < graph_info_score(best))
+		{
+			if(best)
+				graph_info_destroy(best);
+			best = c->best;
+		}
+		else
+			graph_info_destroy(c->best);
+		chain_fini(c);
+	}
+	free(chains);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double seconds = (end.tv_sec - start.tv_sec) +
+					 (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("local search: %.3fs, %u chains, %lu switches tried (%.2fus "
+		   "each), %lu taken, %lu edges added, S: %d -> %d\n", seconds,
+		   num_chains, tried, tried ? cpu_seconds * 1e6 / tried : 0, taken,
+		   added, seed_sum, best->sum_of_distances);
+	return best;
+}
+
+//Checks the distances a chain keeps against a full BFS after every
+//move, starting from a cycle
+void test_local_search(void)
+{
+	int n = 32;
+	graph_info *g = malloc(sizeof(graph_info));
+	g->n = n;
+	g->m = 0;
+	g->max_k = 0;
+	g->k = calloc(n, sizeof(int));
+	g->adj = malloc(n * MAX_K * sizeof(int));
+	g->distances = malloc(n * n * sizeof(int));
+	g->nauty_graph = g->gcan = NULL;
+	g->parent = NULL;
+	g->frozen_adj = NULL;
+	g->new_degree = 0;
+	g->cache_key = g->cache_key_hi = 0;
+	for(int i = 0; i < n; i++)
+		graph_info_add_edge(g, i, (i + 1) % n);
+	bfs_distances(*g);
+	g->sum_of_distances = calc_sum(*g);
+	g->diameter = calc_diameter(*g);
+
+	chain c;
+	chain_init(&c, g, MAX_K, 0, 0);
+	graph_info_destroy(g);
+	int *expected = malloc(n * n * sizeof(int));
+	graph_info check = *c.g;
+	check.distances = expected;
+
+	bool ok = true;
+	add_spare_edges(&c);
+	for(int j = 0; ok && j < 10000; j++)
+	{
+		if(try_switch(&c))
+			add_spare_edges(&c);
+		bfs_distances(check);
+		ok = !memcmp(expected, c.g->distances, n * n * sizeof(int)) &&
+			 c.g->sum_of_distances == calc_sum(check) &&
+			 c.g->diameter == calc_diameter(check);
+	}
+	printf("local search test: %s (%lu switches tried, %lu taken, "
+		   "%lu edges added, S: %d)\n", ok ? "ok" : "FAILED", c.tried,
+		   c.taken, c.added, c.best->sum_of_distances);
+
+	free(expected);
+	graph_info_destroy(c.best);
+	chain_fini(&c);
+}
@@ -0,0 +1,29 @@
+#ifndef __LOCAL_SEARCH_H__
+#define __LOCAL_SEARCH_H__
+
+#include "level.h"
+
+//Hill climbing from the best graphs of the last level, one thread
+//(chain) per seed graph. A chain adds edges between vertices with
+//spare degree while it can, and otherwise tries random switches
+//ab, cd -> ac, bd (which keep every degree), taking any that don't make
+//the score worse, so that it can walk along plateaus. Edges removed in
+//the last LOCAL_SEARCH_TABU switches can't come back.
+//Distances are updated in place after each move rather than redone
+//from scratch: a removed edge only needs a BFS from the vertices that
+//lose their only shortest path through it, and a switch's two added
+//edges are scored together in a single pass over the pairs, which
+//only writes them if the switch is kept. Undoing a switch only undoes
+//what the repairs changed.
+//Chains never canonicalize (nauty isn't reentrant), so the graphs they
+//return have no canonical form.
+
+#define LOCAL_SEARCH_TABU 8
+//Moves each chain tries, unless -i says otherwise
+#define LOCAL_SEARCH_MOVES 100000
+
+graph_info *local_search(level *my_level, unsigned num_chains,
+						 unsigned long num_moves);
+void test_local_search(void);
+
+#endif
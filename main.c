@@ -1,5 +1,14 @@
+#define _POSIX_C_SOURCE 200809L
 #include "level.h"
+#include "pipeline.h"
+#include "shard.h"
+#include "reporter.h"
+#include "local_search.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+#include <time.h>
 
 int geng(int argc, char *argv[]); //entry point for geng
 
@@ -56,56 +65,413 @@ unsigned graph_sizes[] = {
 
 
 
-int main(void)
+#define NUM_GRAPH_SIZES (sizeof(graph_sizes) / sizeof(graph_sizes[0]))
+
+//Search parameters, set from the command line
+static unsigned p = P;
+static unsigned max_n = 13;
+static unsigned hot_p = 0; //0 means don't spill to disk
+static const char *spill_dir = "/tmp";
+static bool compact = false;
+static metrics_cache *cache = NULL;
+static bool canonical_augmentation = false;
+static unsigned num_generators = 0; //0 extends levels on this thread
+static unsigned num_owners = 1;
+static unsigned num_shards = 1;
+static bool fingerprint_only = false;
+static unsigned verify_every = 0;
+static bool delta = false;
+static reporter *report = NULL;
+//Wall-clock budget in seconds, for the whole run or for each level
+//(0 for none), which the width of each level is picked to fit
+static double run_budget = 0, level_budget = 0;
+static bool allocate = false;
+//Local search chains to run from the last level's best graphs (see
+//local_search.h), and the moves each one tries
+static unsigned num_chains = 0;
+static unsigned long num_moves = LOCAL_SEARCH_MOVES;
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+			"Usage: %s [-p beam width] [-n max n] [-s hot size] [-d dir] [-c]\n"
+			"       [-C cache] [-a] [-t generators] [-o owners] [-b]\n"
+			"       [-B max threads] [-S shards] [-F verify every]\n"
+			"       [-D] [-r report] [-T seconds] [-L seconds] [-A]\n"
+			"       [-l chains] [-i moves]\n"
+			"  -s keeps at most this many graphs per m in memory,\n"
+			"     and spills the rest to temporary files in dir\n"
+			"  -c only keeps the canonical form of graphs in memory,\n"
+			"     and recomputes distances when they're extended\n"
+			"  -C keeps the canonical forms of each level's graphs in this\n"
+			"     file (and cache.g6) across runs, by parent and new\n"
+			"     neighbours, so they aren't canonicalized again (implies -c)\n"
+			"  -a only extends each isomorphism class from its canonical\n"
+			"     parent (canonical augmentation), which can lose graphs\n"
+			"     whose canonical parent isn't in the beam\n"
+			"  -t extends levels with a pipeline of this many generator\n"
+			"     threads, one canonicalizer, and -o owner threads (1)\n"
+			"     adding to the level, and reports each stage's stalls\n"
+			"  -S splits each level across this many processes, which\n"
+			"     exchange children through shared memory\n"
+			"  -F tells graphs apart by 128-bit fingerprints instead of\n"
+			"     canonical forms, and recomputes both canonical forms for\n"
+			"     every nth duplicate (0 for none) to count collisions\n"
+			"  -D only keeps each graph's parent, its new vertex's\n"
+			"     neighbours and its fingerprint (implies -c), and\n"
+			"     keeps the parents\n"
+			"  -r writes the best graph of each n and m to this file\n"
+			"     (- for stdout) as soon as each level is done, as\n"
+			"     n m sum diameter seconds graph6\n"
+			"  -T picks the width of each level (starting with -p) to\n"
+			"     finish the run in about this many seconds\n"
+			"  -L does the same for each level\n"
+			"  -A spreads p graphs per m over each level's m by how well\n"
+			"     their graphs did at the levels before\n"
+			"  -l hill climbs from this many of the best graphs at\n"
+			"     max n, each on its own thread, by switching and adding\n"
+			"     edges, trying -i moves each\n"
+			"  -b times dense against sparse canonicalization, and exits\n"
+			"  -B stress tests the striped hash set, times it with up to\n"
+			"     this many threads, and exits\n",
+			name);
+}
+
+static double seconds_since(struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+//Seconds per unit of width it took to extend the last level (of n
+//vertices), and the exponent of n it seems to grow with
+static double cost_per_width = 0, cost_exponent = 3;
+static unsigned cost_n;
+
+//Extending a level takes about as long as its width, but also gets
+//cheaper the narrower the new level is, since it starts rejecting
+//children sooner, so count the widths of both
+static void update_cost(unsigned n, double seconds, unsigned width,
+						unsigned new_width)
+{
+	double cost = seconds / sqrt((double) width * new_width);
+	if(cost_per_width > 0 && cost > 0)
+	{
+		double exponent = log(cost / cost_per_width) / log((double) n / cost_n);
+		exponent = exponent < 1 ? 1 : exponent > 5 ? 5 : exponent;
+		//one level is a noisy measurement
+		cost_exponent = (cost_exponent + exponent) / 2;
+	}
+	cost_per_width = cost;
+	cost_n = n;
+}
+
+//Estimated seconds per unit of width to extend level n
+static double estimated_cost(unsigned n)
+{
+	return cost_per_width * pow((double) n / cost_n, cost_exponent);
+}
+
+//Width for level n + 1, which gets extended after level n (of width
+//cur_p), such that the remaining levels fit in the budget if they all
+//get the same width. Changes by at most 4 times from one level to the
+//next, since the estimate is only as good as the last levels.
+static unsigned budgeted_width(unsigned n, unsigned cur_p, double elapsed)
+{
+	if(cost_per_width == 0)
+		return cur_p; //nothing to go on yet
+	
+	double width;
+	if(level_budget)
+		width = level_budget / estimated_cost(n + 1);
+	else
+	{
+		double left = run_budget - elapsed - estimated_cost(n) * cur_p;
+		double total_cost = 0;
+		for(unsigned i = n + 1; i < max_n; i++)
+			total_cost += estimated_cost(i);
+		if(total_cost == 0)
+			return cur_p; //level n + 1 is the last one, and isn't extended
+		width = left / total_cost;
+	}
+	if(width > 4.0 * cur_p)
+		return 4 * cur_p;
+	if(width < cur_p / 4.0)
+		width = cur_p / 4.0;
+	return width < 1 ? 1 : width;
+}
+
+static level *new_level(unsigned n)
 {
+	level *ret = level_create(n, p, MAX_K);
+	if(ret && hot_p && hot_p < p && !level_set_spill(ret, hot_p, spill_dir))
+		exit(1);
+	if(ret)
+	{
+		ret->compact = compact;
+		ret->cache = cache;
+		ret->canonical_augmentation = canonical_augmentation;
+		ret->fingerprint_only = fingerprint_only;
+		ret->verify_every = verify_every;
+		ret->delta = delta;
+	}
+	return ret;
+}
+
+static bool best_visit(graph_info *g, void *data)
+{
+	graph_info **best_graph = data;
+	if(*best_graph == NULL || graph_info_compare(g, *best_graph) < 0)
+	{
+		if(*best_graph)
+			graph_info_destroy(*best_graph);
+		*best_graph = new_graph_info(*g);
+	}
+	//graphs are visited best first
+	return false;
+}
+
+int main(int argc, char *argv[])
+{
+	struct timespec run_start;
+	clock_gettime(CLOCK_MONOTONIC, &run_start);
+	int opt;
+	const char *cache_path = NULL;
+	const char *report_path = NULL;
+	while((opt = getopt(argc, argv, "p:n:s:d:cC:at:o:S:F:Dr:T:L:Al:i:bB:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'p': p = strtoul(optarg, NULL, 10); break;
+			case 'n': max_n = strtoul(optarg, NULL, 10); break;
+			case 's': hot_p = strtoul(optarg, NULL, 10); break;
+			case 'd': spill_dir = optarg; break;
+			case 'c': compact = true; break;
+			case 'C': cache_path = optarg; break;
+			case 'a': canonical_augmentation = true; break;
+			case 't': num_generators = strtoul(optarg, NULL, 10); break;
+			case 'o': num_owners = strtoul(optarg, NULL, 10); break;
+			case 'S': num_shards = strtoul(optarg, NULL, 10); break;
+			case 'D': delta = true; break;
+			case 'r': report_path = optarg; break;
+			case 'T': run_budget = strtod(optarg, NULL); break;
+			case 'L': level_budget = strtod(optarg, NULL); break;
+			case 'A': allocate = true; break;
+			case 'l': num_chains = strtoul(optarg, NULL, 10); break;
+			case 'i': num_moves = strtoul(optarg, NULL, 10); break;
+			case 'F':
+				fingerprint_only = true;
+				verify_every = strtoul(optarg, NULL, 10);
+				break;
+			case 'b':
+				canon_benchmark();
+				return 0;
+			case 'B':
+				striped_set_test();
+				striped_set_benchmark(strtoul(optarg, NULL, 10));
+				return 0;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	
+	if(max_n > MAX_N)
+	{
+		fprintf(stderr, "n can be at most %d\n", MAX_N);
+		return 1;
+	}
+	
+	if(num_generators && (hot_p || cache_path || num_owners == 0))
+	{
+		fprintf(stderr, "-t needs at least one owner, and doesn't work with "
+				"-s or -C\n");
+		return 1;
+	}
+	
+	if(num_shards == 0 || (num_shards > 1 &&
+						   (hot_p || cache_path || num_generators)))
+	{
+		fprintf(stderr, "-S needs at least one shard, and doesn't work with "
+				"-s, -C or -t\n");
+		return 1;
+	}
+	
+	//-D recomputes canonical forms to tell apart graphs whose
+	//fingerprints match, which the owners can't do
+	if(delta && (hot_p || num_shards > 1 || num_generators))
+	{
+		fprintf(stderr, "-D doesn't work with -s, -S or -t\n");
+		return 1;
+	}
+	
+	//spills and shards are sized by p
+	if(allocate && (hot_p || num_shards > 1))
+	{
+		fprintf(stderr, "-A doesn't work with -s or -S\n");
+		return 1;
+	}
+	
+	//those all need the canonical forms, would verify from other
+	//threads, or (-D) only keep fingerprints already
+	if(fingerprint_only && (compact || delta || hot_p || cache_path ||
+							num_generators || num_shards > 1))
+	{
+		fprintf(stderr, "-F doesn't work with -c, -D, -s, -C, -t or -S\n");
+		return 1;
+	}
+	
+	//-D's graphs are expanded from their parents, so they aren't
+	//labelled canonically
+	if(cache_path && delta)
+	{
+		fprintf(stderr, "-C doesn't work with -D\n");
+		return 1;
+	}
+	
+	//-D stores graphs compacted, but by their parents, and -C needs
+	//parents labelled canonically, which expanding a compact graph does
+	compact = compact || delta || cache_path;
+	
+	if(cache_path && !(cache = metrics_cache_open(cache_path)))
+		return 1;
+	
+	if((report_path || run_budget || level_budget || num_chains) &&
+	   num_shards > 1)
+	{
+		fprintf(stderr, "-r, -T, -L and -l don't work with -S\n");
+		return 1;
+	}
+	if(report_path && !(report = reporter_open(report_path)))
+		return 1;
+	
 	printf("%d\n", MAXM);
 	
 	//find n for geng
 	unsigned n = 3;
-	while(graph_sizes[n] <= P)
+	while(n < NUM_GRAPH_SIZES - 1 && graph_sizes[n] <= p)
 		n++;
 	
 	//setup cur_level for geng_callback()
-	cur_level = level_create(n, P, MAX_K);
+	cur_level = new_level(n);
 	
 	if(call_geng(n, MAX_K))
 		return 1;
+	if(report)
+		reporter_level(report, cur_level);
 	
-	//Main loop
-	for(; n < 13; n++)
+	if(num_shards > 1)
 	{
-		printf("n = %u\n", n);
-		level *new_level = level_create(n + 1, P, MAX_K);
-		level_extend(cur_level, new_level);
-		level_delete(cur_level);
-		cur_level = new_level;
+		graph_info *best_graph = shard_search(cur_level, max_n, p, num_shards,
+											  new_level);
+		if(!best_graph)
+			return 1;
+		print_graph(*best_graph);
+		graph_info_destroy(best_graph);
+		return 0;
 	}
 	
-	graph_info *best_graphs[cur_level->num_m];
+	//with -D, the parents of cur_level's graphs
+	graph_info **frozen = NULL;
+	unsigned num_frozen = 0;
 	
-	for(int i = 0; i < cur_level->num_m; i++)
+	//Main loop
+	for(; n < max_n; n++)
 	{
-		while(priority_queue_num_elems(cur_level->queues[i]) > 1)
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		unsigned long canon_calls = canon_num_calls();
+		unsigned cur_p = cur_level->p;
+		if(run_budget || level_budget)
+		{
+			p = budgeted_width(n, cur_p, seconds_since(&run_start));
+			printf("width of n = %u: %u\n", n + 1, p);
+		}
+		level *next_level = new_level(n + 1);
+		if(allocate)
+		{
+			level_allocate(cur_level, next_level, max_n);
+			if(next_level->caps)
+			{
+				printf("caps of n = %u:", n + 1);
+				for(unsigned i = 0; i < next_level->num_m; i++)
+					printf(" %u", next_level->caps[i]);
+				printf("\n");
+			}
+		}
+		pipeline_stats stats;
+		unsigned long skipped = num_generators ?
+			level_extend_pipelined(cur_level, next_level, num_generators,
+								   num_owners, &stats) :
+			level_extend(cur_level, next_level);
+		if(delta)
 		{
-			graph_info *g = priority_queue_pull(cur_level->queues[i]);
-			graph_info_destroy(g);
+			graph_info **next_frozen;
+			unsigned num_next_frozen = level_freeze(cur_level, next_level,
+													&next_frozen);
+			level_frozen_delete(frozen, num_frozen);
+			frozen = next_frozen;
+			num_frozen = num_next_frozen;
 		}
-		best_graphs[i] = priority_queue_peek(cur_level->queues[i]);
+		else
+			level_delete(cur_level);
+		cur_level = next_level;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double seconds = (end.tv_sec - start.tv_sec) +
+						 (end.tv_nsec - start.tv_nsec) / 1e9;
+		printf("n = %u: %.3fs, %lu parents skipped, %lu canonicalized\n",
+			   n + 1, seconds, skipped, canon_num_calls() - canon_calls);
+		update_cost(n, seconds, cur_p, p);
+		if(num_generators)
+			pipeline_print_stats(&stats);
+		printf("checksum: %016lx\n", level_checksum(cur_level));
+		if(report)
+			reporter_level(report, cur_level);
+		if(cache)
+			level_record_cache(cur_level);
 	}
 	
 	graph_info *best_graph = NULL;
 	for(int i = 0; i < cur_level->num_m; i++)
+		level_foreach(cur_level, i, best_visit, &best_graph);
+	
+	if(num_chains)
 	{
-		if(best_graph == NULL ||
-		   (best_graphs[i] != NULL &&
-		   (best_graphs[i]->sum_of_distances < best_graph->sum_of_distances ||
-		   (best_graphs[i]->sum_of_distances == best_graph->sum_of_distances &&best_graphs[i]->diameter < best_graph->diameter))))
-			best_graph = best_graphs[i];
+		//NULL if the last level is empty, and then so is best_graph
+		graph_info *improved = local_search(cur_level, num_chains, num_moves);
+		if(improved && graph_info_score(improved) <
+					   graph_info_score(best_graph))
+		{
+			graph_info_destroy(best_graph);
+			best_graph = improved;
+		}
+		else if(improved)
+			graph_info_destroy(improved);
 	}
 	
-	print_graph(*best_graph);
-	
+	if(best_graph)
+	{
+		print_graph(*best_graph);
+		graph_info_destroy(best_graph);
+	}
+	else
+		printf("no graphs with %u vertices\n", cur_level->n);
 	level_delete(cur_level);
+	if(frozen)
+		level_frozen_delete(frozen, num_frozen);
+	
+	if(report)
+		reporter_close(report);
+	
+	level_print_dedupe_stats();
+	
+	if(cache)
+	{
+		printf("cache: %lu hits of %lu lookups, %lu graphs\n", cache->hits,
+			   cache->lookups, (unsigned long) cache->header->num_used);
+		metrics_cache_close(cache);
+	}
 	
 	return 0;
 }
@@ -113,5 +479,8 @@ int main(void)
 void geng_callback(FILE *file, graph *g, int n)
 {
 	graph_info *graph = graph_info_from_nauty(g, n);
-	_add_graph_to_level(graph, cur_level);
+	//go through the hash set too, so that every graph in a level
+	//has its canonical form (needed to break ties)
+	if(!add_graph_to_level(graph, cur_level))
+		graph_info_destroy(graph);
 }
\ No newline at end of file
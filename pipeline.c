@@ -0,0 +1,243 @@
+#define _POSIX_C_SOURCE 200809L
+#include "pipeline.h"
+#include "ring.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+
+typedef struct {
+	level *old, *new;
+	parent_ref *parents;
+	unsigned num_parents;
+	unsigned *max_diameter;
+	//index (into parents) of the best parent of each bucket that's known
+	//to have no children left that can get into new, num_parents if
+	//there isn't one yet. Only used atomically.
+	unsigned long *rejected_from;
+	
+	//shared between threads, only used atomically
+	unsigned long next_parent;
+	unsigned long active_generators;
+	unsigned long skipped;
+	unsigned long children;
+	unsigned long generator_stalls;
+	
+	mpsc_ring to_canon;
+	unsigned num_owners;
+	spsc_ring *to_owners;
+} pipeline;
+
+typedef struct {
+	pipeline *p;
+	unsigned long children, stalls;
+} generator;
+
+typedef struct {
+	pipeline *p;
+	unsigned index;
+	pthread_t thread;
+	unsigned long idle, depth_sum, pops;
+} owner;
+
+static void generator_offer(graph_info *child, void *data)
+{
+	generator *gen = data;
+	gen->children++;
+	while(!mpsc_ring_push(&gen->p->to_canon, child))
+	{
+		gen->stalls++;
+		sched_yield();
+	}
+}
+
+static void *generator_main(void *data)
+{
+	pipeline *p = data;
+	generator gen = {p, 0, 0};
+	while(true)
+	{
+		unsigned long j = __atomic_fetch_add(&p->next_parent, 1,
+											 __ATOMIC_RELAXED);
+		if(j >= p->num_parents)
+			break;
+		
+		//thresholds only go down, so once a parent is rejected, so is
+		//everything after it in its bucket. Parents before it may still
+		//be taken by other generators, and get checked on their own.
+		parent_ref *ref = &p->parents[j];
+		unsigned long *rejected_from = &p->rejected_from[ref->i];
+		if(j > __atomic_load_n(rejected_from, __ATOMIC_RELAXED) ||
+		   level_children_rejected(p->old, ref->i,
+								   ref->graph->sum_of_distances,
+								   p->max_diameter[ref->i], p->new))
+		{
+			unsigned long from = __atomic_load_n(rejected_from,
+												 __ATOMIC_RELAXED);
+			while(j < from &&
+				  !__atomic_compare_exchange_n(rejected_from, &from, j, true,
+											   __ATOMIC_RELAXED,
+											   __ATOMIC_RELAXED))
+				;
+			__atomic_fetch_add(&p->skipped, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		
+		graph_info *g = ref->graph;
+		bool compact = !g->distances;
+		if(compact)
+			graph_info_expand(g);
+		extend_graph(g, p->new, generator_offer, &gen);
+		if(compact)
+			graph_info_compact(g);
+	}
+	
+	__atomic_fetch_add(&p->children, gen.children, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&p->generator_stalls, gen.stalls, __ATOMIC_RELAXED);
+	//after every push, so the canonicalizer sees them all once it sees 0
+	__atomic_fetch_sub(&p->active_generators, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void *owner_main(void *data)
+{
+	owner *o = data;
+	spsc_ring *ring = &o->p->to_owners[o->index];
+	while(true)
+	{
+		void *elem;
+		if(!spsc_ring_pop(ring, &elem))
+		{
+			o->idle++;
+			sched_yield();
+			continue;
+		}
+		if(!elem)
+			break; //the canonicalizer is done
+		o->depth_sum += spsc_ring_size(ring);
+		o->pops++;
+		
+		graph_info *child = elem;
+		if(!add_graph_to_level(child, o->p->new))
+			graph_info_destroy(child);
+	}
+	return NULL;
+}
+
+//Runs on the calling thread until every generator is done, and tells
+//the owners to stop
+static void canonicalize_all(pipeline *p, pipeline_stats *stats)
+{
+	level *new = p->new;
+	unsigned long depth_sum = 0, pops = 0;
+	while(true)
+	{
+		bool finished = __atomic_load_n(&p->active_generators,
+										__ATOMIC_ACQUIRE) == 0;
+		void *elem;
+		if(!mpsc_ring_pop(&p->to_canon, &elem))
+		{
+			if(finished)
+				break;
+			stats->canon_idle++;
+			sched_yield();
+			continue;
+		}
+		depth_sum += mpsc_ring_size(&p->to_canon);
+		pops++;
+		
+		//the thresholds may have come down since it was scored
+		graph_info *child = elem;
+		if(level_rejects_score(new, child->m, graph_info_score(child)) ||
+		   (new->canonical_augmentation && !is_canonical_child(child)))
+		{
+			graph_info_destroy(child);
+			continue;
+		}
+		calc_gcan(child);
+		
+		spsc_ring *ring = &p->to_owners[(child->m - new->min_m) % p->num_owners];
+		while(!spsc_ring_push(ring, child))
+		{
+			stats->canon_stalls++;
+			sched_yield();
+		}
+	}
+	
+	for(unsigned i = 0; i < p->num_owners; i++)
+		while(!spsc_ring_push(&p->to_owners[i], NULL))
+			sched_yield();
+	stats->canon_depth = pops ? (double) depth_sum / pops : 0;
+}
+
+//Same as level_extend() on a level that doesn't spill, with
+//num_generators threads generating and num_owners threads adding to new.
+//Fills in stats.
+unsigned long level_extend_pipelined(level *old, level *new,
+									 unsigned num_generators,
+									 unsigned num_owners,
+									 pipeline_stats *stats)
+{
+	pipeline p;
+	unsigned max_diameter[old->num_m];
+	unsigned long rejected_from[old->num_m];
+	p.old = old;
+	p.new = new;
+	p.num_parents = level_sorted_parents(old, &p.parents, max_diameter);
+	p.max_diameter = max_diameter;
+	for(unsigned i = 0; i < old->num_m; i++)
+		rejected_from[i] = p.num_parents;
+	p.rejected_from = rejected_from;
+	p.next_parent = 0;
+	p.active_generators = num_generators;
+	p.skipped = p.children = p.generator_stalls = 0;
+	mpsc_ring_init(&p.to_canon, PIPELINE_RING_SIZE);
+	p.num_owners = num_owners;
+	p.to_owners = malloc(num_owners * sizeof(spsc_ring));
+	
+	stats->canon_idle = stats->canon_stalls = stats->owner_idle = 0;
+	
+	owner owners[num_owners];
+	for(unsigned i = 0; i < num_owners; i++)
+	{
+		spsc_ring_init(&p.to_owners[i], PIPELINE_RING_SIZE);
+		owners[i].p = &p;
+		owners[i].index = i;
+		owners[i].idle = owners[i].depth_sum = owners[i].pops = 0;
+		pthread_create(&owners[i].thread, NULL, owner_main, &owners[i]);
+	}
+	pthread_t generators[num_generators];
+	for(unsigned i = 0; i < num_generators; i++)
+		pthread_create(&generators[i], NULL, generator_main, &p);
+	
+	canonicalize_all(&p, stats);
+	
+	for(unsigned i = 0; i < num_generators; i++)
+		pthread_join(generators[i], NULL);
+	unsigned long depth_sum = 0, pops = 0;
+	for(unsigned i = 0; i < num_owners; i++)
+	{
+		pthread_join(owners[i].thread, NULL);
+		stats->owner_idle += owners[i].idle;
+		depth_sum += owners[i].depth_sum;
+		pops += owners[i].pops;
+		spsc_ring_fini(&p.to_owners[i]);
+	}
+	stats->owner_depth = pops ? (double) depth_sum / pops : 0;
+	stats->children = p.children;
+	stats->generator_stalls = p.generator_stalls;
+	
+	free(p.to_owners);
+	mpsc_ring_fini(&p.to_canon);
+	free(p.parents);
+	return p.skipped;
+}
+
+void pipeline_print_stats(pipeline_stats *stats)
+{
+	printf("  %lu children; generators stalled %lu times; "
+		   "canonicalizer: %.1f waiting, idle %lu, stalled %lu; "
+		   "owners: %.1f waiting, idle %lu\n",
+		   stats->children, stats->generator_stalls, stats->canon_depth,
+		   stats->canon_idle, stats->canon_stalls, stats->owner_depth,
+		   stats->owner_idle);
+}
@@ -0,0 +1,38 @@
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include "level.h"
+
+//level_extend() as a pipeline of threads:
+//  generators (any number) expand parents, and score and build their
+//  children, handing them over an MPSC ring to
+//  the canonicalizer (the calling thread, since nauty isn't
+//  reentrant), which hands them over one SPSC ring per owner to
+//  owners (any number), each of which adds graphs to its own buckets
+//  of the new level (m mod the number of owners).
+//Children are only scored against thresholds that the owners publish
+//(see level_rejects_score()), and owners make the final decision, so
+//the new level is the same as level_extend()'s.
+//Doesn't support spilling or the metrics cache.
+
+//Slots in each ring
+#define PIPELINE_RING_SIZE 1024
+
+//Where the time went. A stage stalls when the ring after it is full,
+//and idles when the ring before it is empty; depths are averaged over
+//every pop. A full ring in front of a stage makes it the bottleneck.
+typedef struct {
+	unsigned long children; //built by the generators
+	unsigned long generator_stalls;
+	unsigned long canon_idle, canon_stalls;
+	unsigned long owner_idle;
+	double canon_depth, owner_depth;
+} pipeline_stats;
+
+unsigned long level_extend_pipelined(level *old, level *new,
+									 unsigned num_generators,
+									 unsigned num_owners,
+									 pipeline_stats *stats);
+void pipeline_print_stats(pipeline_stats *stats);
+
+#endif
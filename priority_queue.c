@@ -1,74 +1,82 @@
 #include "priority_queue.h"
 #include <stdio.h>
-#include <stdlib.h>
+#include <string.h>
+
+#define GENERIC_COMPARE_GT(queue, elem1, elem2) \
+	((queue)->compare_gt((elem1), (elem2)))
+
+DEFINE_HEAP_FUNCS(heap, void*, priority_queue*, GENERIC_COMPARE_GT)
 
 priority_queue *priority_queue_create(bool (*compare_gt)(void *elem1, void *elem2),
 									  void (*delete)(void *elem))
 {
 	priority_queue *queue = malloc(sizeof(priority_queue));
+	if(!queue)
+		return NULL;
 	queue->elems = NULL;
 	queue->num_elems = 0;
+	queue->capacity = 0;
 	queue->compare_gt = compare_gt;
 	queue->delete = delete;
 	return queue;
 }
 
-void priority_queue_delete(priority_queue *queue)
+//Builds a queue holding a copy of elems in O(num_elems)
+priority_queue *priority_queue_create_from_array(void **elems, unsigned num_elems,
+												 bool (*compare_gt)(void *elem1, void *elem2),
+												 void (*delete)(void *elem))
 {
-	if(queue->elems)
+	priority_queue *queue = priority_queue_create(compare_gt, delete);
+	if(!queue)
+		return NULL;
+	if(!priority_queue_reserve(queue, num_elems))
 	{
-		for(int i = 0; i < queue->num_elems; i++)
-			queue->delete(queue->elems[i]);
-		free(queue->elems);
+		free(queue);
+		return NULL;
 	}
+	memcpy(queue->elems, elems, num_elems * sizeof(void*));
+	queue->num_elems = num_elems;
+	heap_heapify(queue->elems, num_elems, queue);
+	return queue;
+}
+
+void priority_queue_delete(priority_queue *queue)
+{
+	for(unsigned i = 0; i < queue->num_elems; i++)
+		queue->delete(queue->elems[i]);
+	free(queue->elems);
 	free(queue);
 }
 
-unsigned priority_queue_num_elems(priority_queue *queue)
+//Makes sure capacity elements fit without reallocating.
+//The queue never shrinks, so pulling and refilling doesn't allocate.
+bool priority_queue_reserve(priority_queue *queue, unsigned capacity)
 {
-	return queue->num_elems;
+	if(capacity <= queue->capacity)
+		return true;
+	void **elems = realloc(queue->elems, capacity * sizeof(void*));
+	if(!elems)
+		return false;
+	queue->elems = elems;
+	queue->capacity = capacity;
+	return true;
 }
 
-static bool is_power_of_two(unsigned num)
+unsigned priority_queue_num_elems(priority_queue *queue)
 {
-	return !(num & (num - 1));
+	return queue->num_elems;
 }
 
 bool priority_queue_push(priority_queue *queue, void *elem)
 {
-	if(queue->num_elems == 0)
-	{
-		queue->num_elems = 1;
-		queue->elems = malloc(sizeof(void*));
-		if(!queue->elems)
-			return false;
-		queue->elems[0] = elem;
-		return true;
-	}
-	
-	if(is_power_of_two(queue->num_elems))
-	{
-		queue->elems = realloc(queue->elems, queue->num_elems * 2 *sizeof(void*));
-		if(!queue->elems)
-			return false;
-	}
+	if(queue->num_elems == queue->capacity &&
+	   !priority_queue_reserve(queue, queue->capacity ? 2 * queue->capacity : 16))
+		return false;
 	
 	queue->elems[queue->num_elems] = elem;
-	
-	unsigned cur_elem = queue->num_elems;
-	while(cur_elem != 0)
-	{
-		unsigned parent = (cur_elem - 1) / 2;
-		if(!queue->compare_gt(queue->elems[cur_elem], queue->elems[parent]))
-			break;
-		
-		void *temp = queue->elems[parent];
-		queue->elems[parent] = queue->elems[cur_elem];
-		queue->elems[cur_elem] = temp;
-		cur_elem = parent;
-	}
-	
+	heap_sift_up(queue->elems, queue->num_elems, queue);
 	queue->num_elems++;
+	return true;
 }
 
 void *priority_queue_pull(priority_queue *queue)
@@ -77,47 +85,9 @@ void *priority_queue_pull(priority_queue *queue)
 		return NULL;
 	
 	void *ret = queue->elems[0];
-	
-	if(queue->num_elems == 1)
-	{
-		free(queue->elems);
-		queue->elems = NULL;
-		queue->num_elems--;
-		return ret;
-	}
-	
-	queue->elems[0] = queue->elems[queue->num_elems-1];
-	
-	unsigned cur_elem = 0;
-	while (true)
-	{
-		unsigned smallest = cur_elem;
-		unsigned left = 2*cur_elem + 1;
-		unsigned right = 2*cur_elem + 2;
-		if(left < queue->num_elems - 1 &&
-		   queue->compare_gt(queue->elems[left], queue->elems[smallest]))
-		   smallest = left;
-		if(right < queue->num_elems - 1 &&
-		   queue->compare_gt(queue->elems[right], queue->elems[smallest]))
-		   smallest = right;
-		
-		if(smallest == cur_elem)
-			break;
-		
-		void *temp = queue->elems[smallest];
-		queue->elems[smallest] = queue->elems[cur_elem];
-		queue->elems[cur_elem] = temp;
-		cur_elem = smallest;
-	}
-	
 	queue->num_elems--;
-	if(is_power_of_two(queue->num_elems))
-	{
-		queue->elems = realloc(queue->elems, queue->num_elems * sizeof(void*));
-		if(!queue->elems)
-			return NULL;
-	}
-
+	queue->elems[0] = queue->elems[queue->num_elems];
+	heap_sift_down(queue->elems, queue->num_elems, 0, queue);
 	return ret;
 }
 
@@ -141,8 +111,12 @@ void priority_queue_test(void)
 {
 	priority_queue *queue = priority_queue_create(compare_gt, delete);
 	int ints[1000];
+	void *ptrs[1000];
 	for(int i = 0; i < 1000; i++)
-		ints[i] = i;
+	{
+		ints[i] = (i * 7919) % 1000;
+		ptrs[i] = ints + i;
+	}
 	for(int i = 0; i < 1000; i++)
 		priority_queue_push(queue, ints + i);
 	for(int i = 0; i < 1000; i++)
@@ -152,4 +126,13 @@ void priority_queue_test(void)
 	}
 	printf("\n");
 	priority_queue_delete(queue);
-}
\ No newline at end of file
+	
+	queue = priority_queue_create_from_array(ptrs, 1000, compare_gt, delete);
+	for(int i = 999; i >= 0; i--)
+	{
+		int *val = priority_queue_pull(queue);
+		if(*val != i)
+			printf("Error: heapified queue returned %d instead of %d\n", *val, i);
+	}
+	priority_queue_delete(queue);
+}
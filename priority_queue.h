@@ -2,19 +2,282 @@
 #define __PRIORITY_QUEUE_H__
 
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 
-//Implement priority queue using a binary heap
+//Implement priority queue using a 4-ary heap.
+//A node's children are all in the same cache line (for pointers),
+//and the heap is half as deep as a binary one.
+
+#define PRIORITY_QUEUE_ARITY 4
+
+//Generates the heap algorithms for an array of type, as static functions
+//name_sift_up(), name_sift_down() and name_heapify().
+//compare_gt(ctx, elem1, elem2) is expanded inline, so it can be a macro
+//that ignores ctx, or one that calls through a pointer stored in ctx.
+#define DEFINE_HEAP_FUNCS(name, type, ctx_type, compare_gt) \
+static inline void name##_sift_up(type *elems, unsigned cur, ctx_type ctx) \
+{ \
+	type elem = elems[cur]; \
+	while(cur != 0) \
+	{ \
+		unsigned parent = (cur - 1) / PRIORITY_QUEUE_ARITY; \
+		if(!compare_gt(ctx, elem, elems[parent])) \
+			break; \
+		elems[cur] = elems[parent]; \
+		cur = parent; \
+	} \
+	elems[cur] = elem; \
+} \
+\
+static inline void name##_sift_down(type *elems, unsigned num_elems, \
+									unsigned cur, ctx_type ctx) \
+{ \
+	type elem = elems[cur]; \
+	while(true) \
+	{ \
+		unsigned first = PRIORITY_QUEUE_ARITY * cur + 1; \
+		if(first >= num_elems) \
+			break; \
+		unsigned last = first + PRIORITY_QUEUE_ARITY; \
+		if(last > num_elems) \
+			last = num_elems; \
+		unsigned largest = first; \
+		for(unsigned child = first + 1; child < last; child++) \
+			if(compare_gt(ctx, elems[child], elems[largest])) \
+				largest = child; \
+		if(!compare_gt(ctx, elems[largest], elem)) \
+			break; \
+		elems[cur] = elems[largest]; \
+		cur = largest; \
+	} \
+	elems[cur] = elem; \
+} \
+\
+/* Floyd's bottom-up construction, O(num_elems) */ \
+static inline void name##_heapify(type *elems, unsigned num_elems, \
+								  ctx_type ctx) \
+{ \
+	if(num_elems < 2) \
+		return; \
+	for(unsigned i = (num_elems - 2) / PRIORITY_QUEUE_ARITY + 1; i > 0; i--) \
+		name##_sift_down(elems, num_elems, i - 1, ctx); \
+}
+
+//Generates a queue type called name, holding elements of type, along
+//with static functions name_init(), name_push(), etc. mirroring the
+//generic priority_queue API below. compare_gt(elem1, elem2) is inlined.
+#define DEFINE_PRIORITY_QUEUE(name, type, compare_gt) \
+typedef struct { \
+	type *elems; \
+	unsigned num_elems; \
+	unsigned capacity; \
+} name; \
+\
+static inline bool name##_compare_gt_(void *ctx, type elem1, type elem2) \
+{ \
+	return compare_gt(elem1, elem2); \
+} \
+DEFINE_HEAP_FUNCS(name##_heap, type, void*, name##_compare_gt_) \
+\
+static inline void name##_init(name *queue) \
+{ \
+	queue->elems = NULL; \
+	queue->num_elems = 0; \
+	queue->capacity = 0; \
+} \
+\
+static inline void name##_fini(name *queue) \
+{ \
+	free(queue->elems); \
+} \
+\
+static inline bool name##_reserve(name *queue, unsigned capacity) \
+{ \
+	if(capacity <= queue->capacity) \
+		return true; \
+	type *elems = realloc(queue->elems, capacity * sizeof(type)); \
+	if(!elems) \
+		return false; \
+	queue->elems = elems; \
+	queue->capacity = capacity; \
+	return true; \
+} \
+\
+static inline bool name##_push(name *queue, type elem) \
+{ \
+	if(queue->num_elems == queue->capacity && \
+	   !name##_reserve(queue, queue->capacity ? 2 * queue->capacity : 16)) \
+		return false; \
+	queue->elems[queue->num_elems] = elem; \
+	name##_heap_sift_up(queue->elems, queue->num_elems++, NULL); \
+	return true; \
+} \
+\
+/* The queue must not be empty */ \
+static inline type name##_pull(name *queue) \
+{ \
+	type ret = queue->elems[0]; \
+	queue->elems[0] = queue->elems[--queue->num_elems]; \
+	name##_heap_sift_down(queue->elems, queue->num_elems, 0, NULL); \
+	return ret; \
+} \
+\
+static inline type name##_peek(name *queue) \
+{ \
+	return queue->elems[0]; \
+} \
+\
+static inline unsigned name##_num_elems(name *queue) \
+{ \
+	return queue->num_elems; \
+}
+
+//Generates a queue type called name for elements whose order is mostly
+//given by a small unsigned integer, key(elem), with compare_gt(elem1,
+//elem2) (consistent with key) only breaking ties. There is one heap per
+//key (name_bucket, from DEFINE_PRIORITY_QUEUE()), over a dense range of
+//keys that grows to fit whatever is pushed, and the greatest nonempty
+//key is tracked. Peeking at the greatest element is O(1), pushing and
+//pulling only sift within one key's heap, and pulling only scans down
+//to the next nonempty key when a heap runs out.
+//name_sorted() writes out every element in increasing order.
+#define DEFINE_BUCKET_QUEUE(name, type, key, compare_gt) \
+DEFINE_PRIORITY_QUEUE(name##_bucket, type, compare_gt) \
+\
+typedef struct { \
+	name##_bucket *buckets; /* buckets[i] holds key min_key + i */ \
+	unsigned long min_key; \
+	unsigned num_buckets; \
+	unsigned top; /* the greatest nonempty bucket */ \
+	unsigned num_elems; \
+} name; \
+\
+static inline void name##_init(name *queue) \
+{ \
+	queue->buckets = NULL; \
+	queue->min_key = 0; \
+	queue->num_buckets = 0; \
+	queue->top = 0; \
+	queue->num_elems = 0; \
+} \
+\
+static inline void name##_fini(name *queue) \
+{ \
+	for(unsigned i = 0; i < queue->num_buckets; i++) \
+		name##_bucket_fini(&queue->buckets[i]); \
+	free(queue->buckets); \
+} \
+\
+/* Grows the range of buckets to [lo, hi] (at least) */ \
+static inline bool name##_grow_(name *queue, unsigned long lo, \
+								unsigned long hi) \
+{ \
+	if(queue->num_buckets) \
+	{ \
+		if(lo > queue->min_key) \
+			lo = queue->min_key; \
+		if(hi < queue->min_key + queue->num_buckets - 1) \
+			hi = queue->min_key + queue->num_buckets - 1; \
+	} \
+	unsigned num_buckets = hi - lo + 1; \
+	if(queue->num_buckets && num_buckets < 2 * queue->num_buckets) \
+	{ \
+		/* leave room to grow the same way again */ \
+		num_buckets = 2 * queue->num_buckets; \
+		if(lo < queue->min_key) \
+			lo = hi + 1 - num_buckets > hi ? 0 : hi + 1 - num_buckets; \
+	} \
+	name##_bucket *buckets = calloc(num_buckets, sizeof(name##_bucket)); \
+	if(!buckets) \
+		return false; \
+	unsigned shift = queue->min_key - lo; \
+	if(queue->num_buckets) \
+		memcpy(buckets + shift, queue->buckets, \
+			   queue->num_buckets * sizeof(name##_bucket)); \
+	free(queue->buckets); \
+	queue->buckets = buckets; \
+	queue->top += queue->num_buckets ? shift : 0; \
+	queue->min_key = lo; \
+	queue->num_buckets = num_buckets; \
+	return true; \
+} \
+\
+static inline bool name##_push(name *queue, type elem) \
+{ \
+	unsigned long k = key(elem); \
+	if((!queue->num_buckets || k < queue->min_key || \
+		k >= queue->min_key + queue->num_buckets) && \
+	   !name##_grow_(queue, k, k)) \
+		return false; \
+	unsigned i = k - queue->min_key; \
+	if(!name##_bucket_push(&queue->buckets[i], elem)) \
+		return false; \
+	if(queue->num_elems++ == 0 || i > queue->top) \
+		queue->top = i; \
+	return true; \
+} \
+\
+/* The queue must not be empty */ \
+static inline type name##_peek(name *queue) \
+{ \
+	return name##_bucket_peek(&queue->buckets[queue->top]); \
+} \
+\
+/* The queue must not be empty */ \
+static inline type name##_pull(name *queue) \
+{ \
+	type ret = name##_bucket_pull(&queue->buckets[queue->top]); \
+	if(--queue->num_elems) \
+		while(!name##_bucket_num_elems(&queue->buckets[queue->top])) \
+			queue->top--; \
+	return ret; \
+} \
+\
+static inline unsigned name##_num_elems(name *queue) \
+{ \
+	return queue->num_elems; \
+} \
+\
+/* Writes every element to out (room for name_num_elems()), least */ \
+/* first. Each heap is copied and heapsorted in place. */ \
+static inline void name##_sorted(name *queue, type *out) \
+{ \
+	if(!queue->num_elems) \
+		return; \
+	for(unsigned i = 0; i <= queue->top; i++) \
+	{ \
+		name##_bucket *bucket = &queue->buckets[i]; \
+		unsigned num = bucket->num_elems; \
+		if(!num) \
+			continue; \
+		memcpy(out, bucket->elems, num * sizeof(type)); \
+		for(unsigned end = num; end > 1; end--) \
+		{ \
+			type greatest = out[0]; \
+			out[0] = out[end - 1]; \
+			out[end - 1] = greatest; \
+			name##_bucket_heap_sift_down(out, end - 1, 0, NULL); \
+		} \
+		out += num; \
+	} \
+}
 
 typedef struct {
 	void **elems;
 	unsigned num_elems;
+	unsigned capacity;
 	bool (*compare_gt)(void *elem1, void *elem2);
 	void (*delete)(void *elem);
 } priority_queue;
 
 priority_queue *priority_queue_create(bool (*compare_gt)(void *elem1, void *elem2),
 									  void (*delete)(void *elem));
+priority_queue *priority_queue_create_from_array(void **elems, unsigned num_elems,
+												 bool (*compare_gt)(void *elem1, void *elem2),
+												 void (*delete)(void *elem));
 void priority_queue_delete(priority_queue *queue);
+bool priority_queue_reserve(priority_queue *queue, unsigned capacity);
 unsigned priority_queue_num_elems(priority_queue *queue);
 bool priority_queue_push(priority_queue *queue, void *elem);
 void *priority_queue_pull(priority_queue *queue);
@@ -22,4 +285,4 @@ void *priority_queue_peek(priority_queue* queue);
 void priority_queue_test(void);
 
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,115 @@
+#define _POSIX_C_SOURCE 200809L
+#include "reporter.h"
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void *writer_main(void *data)
+{
+	reporter *r = data;
+	while(true)
+	{
+		void *line;
+		bool wrote = false;
+		while(spsc_ring_pop(&r->lines, &line))
+		{
+			fputs(line, r->file);
+			free(line);
+			wrote = true;
+		}
+		if(wrote)
+			fflush(r->file);
+		
+		pthread_mutex_lock(&r->lock);
+		while(!r->done && spsc_ring_size(&r->lines) == 0)
+			pthread_cond_wait(&r->wake, &r->lock);
+		bool done = r->done && spsc_ring_size(&r->lines) == 0;
+		pthread_mutex_unlock(&r->lock);
+		if(done)
+			return NULL;
+	}
+}
+
+//Writes to path, or to stdout if path is "-"
+reporter *reporter_open(const char *path)
+{
+	FILE *file = strcmp(path, "-") ? fopen(path, "w") : stdout;
+	if(!file)
+	{
+		perror(path);
+		return NULL;
+	}
+	
+	reporter *r = malloc(sizeof(reporter));
+	r->file = file;
+	clock_gettime(CLOCK_MONOTONIC, &r->start);
+	spsc_ring_init(&r->lines, REPORTER_RING_SIZE);
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->wake, NULL);
+	r->done = false;
+	r->stalls = 0;
+	pthread_create(&r->writer, NULL, writer_main, r);
+	return r;
+}
+
+//Waits for everything to be written
+void reporter_close(reporter *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->done = true;
+	pthread_cond_signal(&r->wake);
+	pthread_mutex_unlock(&r->lock);
+	pthread_join(r->writer, NULL);
+	
+	if(r->file != stdout)
+		fclose(r->file);
+	//the search would have been held up that many times
+	if(r->stalls)
+		printf("reporter: the search waited for the writer %lu times\n",
+			   r->stalls);
+	pthread_cond_destroy(&r->wake);
+	pthread_mutex_destroy(&r->lock);
+	spsc_ring_fini(&r->lines);
+	free(r);
+}
+
+typedef struct {
+	reporter *r;
+	double seconds;
+} report_state;
+
+//Only called with the best graph of each m
+static bool report_visit(graph_info *g, void *data)
+{
+	report_state *state = data;
+	char *g6 = graph_info_g6(g);
+	const char *format = "%d %d %d %d %.3f %s";
+	int len = snprintf(NULL, 0, format, g->n, g->m, g->sum_of_distances,
+					   g->diameter, state->seconds, g6);
+	char *line = malloc(len + 1);
+	snprintf(line, len + 1, format, g->n, g->m, g->sum_of_distances,
+			 g->diameter, state->seconds, g6);
+	free(g6);
+	
+	while(!spsc_ring_push(&state->r->lines, line))
+	{
+		state->r->stalls++;
+		sched_yield();
+	}
+	return false;
+}
+
+//Queues the best graph of each m in my_level
+void reporter_level(reporter *r, level *my_level)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	report_state state = {r, (now.tv_sec - r->start.tv_sec) +
+							 (now.tv_nsec - r->start.tv_nsec) / 1e9};
+	for(unsigned i = 0; i < my_level->num_m; i++)
+		level_foreach(my_level, i, report_visit, &state);
+	
+	pthread_mutex_lock(&r->lock);
+	pthread_cond_signal(&r->wake);
+	pthread_mutex_unlock(&r->lock);
+}
@@ -0,0 +1,38 @@
+#ifndef __REPORTER_H__
+#define __REPORTER_H__
+
+#include "level.h"
+#include "ring.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+//Streams the best graph of each m to a file as soon as each level is
+//done, one line per graph:
+//  n m sum_of_distances diameter seconds graph6
+//where seconds is the time since reporter_open(). Lines are formatted
+//on the search's thread, and written and flushed by a thread of their
+//own, so a slow file never holds up the search.
+
+//Lines waiting to be written before reporter_level() has to wait
+#define REPORTER_RING_SIZE 4096
+
+typedef struct {
+	FILE *file;
+	struct timespec start;
+	
+	spsc_ring lines;
+	pthread_t writer;
+	//the writer sleeps on wake while lines is empty
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	bool done;
+	
+	unsigned long stalls; //times lines was full
+} reporter;
+
+reporter *reporter_open(const char *path);
+void reporter_level(reporter *r, level *my_level);
+void reporter_close(reporter *r);
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+//Bounded lock-free rings of pointers, for handing work between threads.
+//push() and pop() never block: they return false when the ring is full
+//or empty, and the caller decides whether to spin, yield or do
+//something else. Indices only ever grow, and are masked into the slots.
+
+#define RING_CACHE_LINE 64
+
+//Single producer, single consumer.
+//Each side owns one index, and only reads the other's (with acquire)
+//to see how far it may go.
+typedef struct {
+	void **slots;
+	unsigned long mask; //capacity - 1, capacity is a power of two
+	char pad0[RING_CACHE_LINE];
+	unsigned long head; //next slot to pop, written by the consumer
+	char pad1[RING_CACHE_LINE];
+	unsigned long tail; //next slot to push, written by the producer
+	char pad2[RING_CACHE_LINE];
+} spsc_ring;
+
+static inline bool spsc_ring_init(spsc_ring *r, unsigned long capacity)
+{
+	unsigned long size = 2;
+	while(size < capacity)
+		size *= 2;
+	r->slots = malloc(size * sizeof(void*));
+	r->mask = size - 1;
+	r->head = r->tail = 0;
+	return r->slots != NULL;
+}
+
+static inline void spsc_ring_fini(spsc_ring *r)
+{
+	free(r->slots);
+}
+
+static inline bool spsc_ring_push(spsc_ring *r, void *elem)
+{
+	unsigned long tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	if(tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) > r->mask)
+		return false;
+	r->slots[tail & r->mask] = elem;
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static inline bool spsc_ring_pop(spsc_ring *r, void **elem)
+{
+	unsigned long head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	if(head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+		return false;
+	*elem = r->slots[head & r->mask];
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+//Number of elements, as seen from either side
+static inline unsigned long spsc_ring_size(spsc_ring *r)
+{
+	return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) -
+		   __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+}
+
+//Multiple producers, single consumer (Vyukov's bounded queue).
+//Producers claim a slot by CASing tail forward. Each slot has a
+//sequence number that says whose turn it is: pos when it's free for
+//the push at pos, pos + 1 once that push has written it, and
+//pos + capacity once the consumer has emptied it again.
+typedef struct {
+	unsigned long seq;
+	void *elem;
+} mpsc_slot;
+
+typedef struct {
+	mpsc_slot *slots;
+	unsigned long mask;
+	char pad0[RING_CACHE_LINE];
+	unsigned long tail; //claimed by producers
+	char pad1[RING_CACHE_LINE];
+	unsigned long head; //only touched by the consumer
+	char pad2[RING_CACHE_LINE];
+} mpsc_ring;
+
+static inline bool mpsc_ring_init(mpsc_ring *r, unsigned long capacity)
+{
+	unsigned long size = 2;
+	while(size < capacity)
+		size *= 2;
+	r->slots = malloc(size * sizeof(mpsc_slot));
+	if(!r->slots)
+		return false;
+	for(unsigned long i = 0; i < size; i++)
+		r->slots[i].seq = i;
+	r->mask = size - 1;
+	r->head = r->tail = 0;
+	return true;
+}
+
+static inline void mpsc_ring_fini(mpsc_ring *r)
+{
+	free(r->slots);
+}
+
+static inline bool mpsc_ring_push(mpsc_ring *r, void *elem)
+{
+	unsigned long pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	while(true)
+	{
+		mpsc_slot *slot = &r->slots[pos & r->mask];
+		long diff = (long) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) -
+							pos);
+		if(diff == 0)
+		{
+			if(__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, true,
+										   __ATOMIC_RELAXED,
+										   __ATOMIC_RELAXED))
+			{
+				slot->elem = elem;
+				__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+				return true;
+			}
+			//pos now holds the current tail
+		}
+		else if(diff < 0)
+			return false; //the consumer hasn't emptied this slot yet
+		else
+			pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	}
+}
+
+static inline bool mpsc_ring_pop(mpsc_ring *r, void **elem)
+{
+	unsigned long pos = r->head;
+	mpsc_slot *slot = &r->slots[pos & r->mask];
+	if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+		return false;
+	*elem = slot->elem;
+	__atomic_store_n(&slot->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+	r->head = pos + 1;
+	return true;
+}
+
+//Number of elements claimed by producers and not popped yet; only
+//meaningful from the consumer
+static inline unsigned long mpsc_ring_size(mpsc_ring *r)
+{
+	return __atomic_load_n(&r->tail, __ATOMIC_RELAXED) - r->head;
+}
+
+#endif
@@ -0,0 +1,192 @@
+#define _POSIX_C_SOURCE 200809L
+#include "score.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+//distances must be connected (no GRAPH_INFINITY) and at most 255
+bool score_batch_init(score_batch *batch, int *distances, unsigned n,
+					  unsigned distances_stride)
+{
+	batch->n = n;
+	batch->stride = (n + SCORE_ALIGN - 1) / SCORE_ALIGN * SCORE_ALIGN;
+	if(posix_memalign((void**) &batch->rows, SCORE_ALIGN,
+					  (n + 1) * batch->stride))
+		return false;
+	memset(batch->rows, 0, (n + 1) * batch->stride);
+	for(unsigned i = 0; i < n; i++)
+		for(unsigned j = 0; j < n; j++)
+			batch->rows[batch->stride*i + j] = distances[distances_stride*i + j];
+	batch->dv = batch->rows + batch->stride * n;
+	return true;
+}
+
+void score_batch_fini(score_batch *batch)
+{
+	free(batch->rows);
+}
+
+#if defined(__AVX2__)
+
+//Fills in batch->dv, and returns sum over all i, j of d'(i, j) and
+//the max of d'(i, j), both without the new vertex
+static void score_kernel(score_batch *batch, unsigned *neighbours,
+						 unsigned size, unsigned long *sum, unsigned *max)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i one = _mm256_set1_epi8(1);
+	for(unsigned j = 0; j < batch->stride; j += 32)
+	{
+		__m256i dv = _mm256_load_si256((__m256i*) (batch->rows +
+									   batch->stride*neighbours[0] + j));
+		for(unsigned s = 1; s < size; s++)
+			dv = _mm256_min_epu8(dv, _mm256_load_si256((__m256i*)
+								 (batch->rows + batch->stride*neighbours[s] + j)));
+		_mm256_store_si256((__m256i*) (batch->dv + j), _mm256_adds_epu8(dv, one));
+	}
+	
+	__m256i acc = zero, mx = zero;
+	for(unsigned i = 0; i < batch->n; i++)
+	{
+		const __m256i dvi = _mm256_set1_epi8(batch->dv[i]);
+		const uint8_t *row = batch->rows + batch->stride*i;
+		for(unsigned j = 0; j < batch->stride; j += 32)
+		{
+			__m256i via = _mm256_adds_epu8(dvi,
+								_mm256_load_si256((__m256i*) (batch->dv + j)));
+			__m256i d = _mm256_min_epu8(_mm256_load_si256((__m256i*) (row + j)),
+										via);
+			mx = _mm256_max_epu8(mx, d);
+			acc = _mm256_add_epi64(acc, _mm256_sad_epu8(d, zero));
+		}
+	}
+	
+	uint64_t acc_lanes[4];
+	uint8_t mx_lanes[32];
+	_mm256_storeu_si256((__m256i*) acc_lanes, acc);
+	_mm256_storeu_si256((__m256i*) mx_lanes, mx);
+	*sum = acc_lanes[0] + acc_lanes[1] + acc_lanes[2] + acc_lanes[3];
+	*max = 0;
+	for(unsigned j = 0; j < 32; j++)
+		if(mx_lanes[j] > *max)
+			*max = mx_lanes[j];
+}
+
+#elif defined(__SSE2__)
+
+static void score_kernel(score_batch *batch, unsigned *neighbours,
+						 unsigned size, unsigned long *sum, unsigned *max)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi8(1);
+	for(unsigned j = 0; j < batch->stride; j += 16)
+	{
+		__m128i dv = _mm_load_si128((__m128i*) (batch->rows +
+									batch->stride*neighbours[0] + j));
+		for(unsigned s = 1; s < size; s++)
+			dv = _mm_min_epu8(dv, _mm_load_si128((__m128i*)
+							  (batch->rows + batch->stride*neighbours[s] + j)));
+		_mm_store_si128((__m128i*) (batch->dv + j), _mm_adds_epu8(dv, one));
+	}
+	
+	__m128i acc = zero, mx = zero;
+	for(unsigned i = 0; i < batch->n; i++)
+	{
+		const __m128i dvi = _mm_set1_epi8(batch->dv[i]);
+		const uint8_t *row = batch->rows + batch->stride*i;
+		for(unsigned j = 0; j < batch->stride; j += 16)
+		{
+			__m128i via = _mm_adds_epu8(dvi,
+								_mm_load_si128((__m128i*) (batch->dv + j)));
+			__m128i d = _mm_min_epu8(_mm_load_si128((__m128i*) (row + j)), via);
+			mx = _mm_max_epu8(mx, d);
+			acc = _mm_add_epi64(acc, _mm_sad_epu8(d, zero));
+		}
+	}
+	
+	uint64_t acc_lanes[2];
+	uint8_t mx_lanes[16];
+	_mm_storeu_si128((__m128i*) acc_lanes, acc);
+	_mm_storeu_si128((__m128i*) mx_lanes, mx);
+	*sum = acc_lanes[0] + acc_lanes[1];
+	*max = 0;
+	for(unsigned j = 0; j < 16; j++)
+		if(mx_lanes[j] > *max)
+			*max = mx_lanes[j];
+}
+
+#else
+
+static void score_kernel(score_batch *batch, unsigned *neighbours,
+						 unsigned size, unsigned long *sum, unsigned *max)
+{
+	for(unsigned j = 0; j < batch->stride; j++)
+	{
+		unsigned dv = batch->rows[batch->stride*neighbours[0] + j];
+		for(unsigned s = 1; s < size; s++)
+			if(batch->rows[batch->stride*neighbours[s] + j] < dv)
+				dv = batch->rows[batch->stride*neighbours[s] + j];
+		batch->dv[j] = dv + 1;
+	}
+	
+	*sum = 0;
+	*max = 0;
+	for(unsigned i = 0; i < batch->n; i++)
+	{
+		const uint8_t *row = batch->rows + batch->stride*i;
+		for(unsigned j = 0; j < batch->n; j++)
+		{
+			unsigned d = batch->dv[i] + batch->dv[j];
+			if(row[j] < d)
+				d = row[j];
+			*sum += d;
+			if(d > *max)
+				*max = d;
+		}
+	}
+}
+
+#endif
+
+//Scores the child where the new vertex is joined to the given vertices
+//of the parent. Leaves the new vertex's distances in batch->dv.
+void score_child(score_batch *batch, unsigned *neighbours, unsigned size,
+				 int *sum_of_distances, int *diameter)
+{
+	unsigned long sum;
+	unsigned max;
+	score_kernel(batch, neighbours, size, &sum, &max);
+	
+	//the kernel counted each pair twice, and left out the new vertex
+	sum /= 2;
+	for(unsigned i = 0; i < batch->n; i++)
+	{
+		sum += batch->dv[i];
+		if(batch->dv[i] > max)
+			max = batch->dv[i];
+	}
+	*sum_of_distances = sum;
+	*diameter = max;
+}
+
+//Writes the distance matrix of the child last passed to score_child()
+void score_child_distances(score_batch *batch, int *distances,
+						   unsigned distances_stride)
+{
+	unsigned n = batch->n;
+	for(unsigned i = 0; i < n; i++)
+	{
+		const uint8_t *row = batch->rows + batch->stride*i;
+		for(unsigned j = 0; j < n; j++)
+		{
+			int d = batch->dv[i] + batch->dv[j];
+			distances[distances_stride*i + j] = row[j] < d ? row[j] : d;
+		}
+		distances[distances_stride*i + n] = distances[distances_stride*n + i] =
+			batch->dv[i];
+	}
+	distances[distances_stride*n + n] = 0;
+}
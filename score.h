@@ -0,0 +1,32 @@
+#ifndef __SCORE_H__
+#define __SCORE_H__
+
+#include "graph.h"
+#include <stdint.h>
+
+//Scores the children of a graph without building them.
+//If the new vertex v is joined to the set S, then
+//  d(v, i) = 1 + min over j in S of D[j][i]
+//  d'(i, j) = min(D[i][j], d(v, i) + d(v, j))
+//so the child's sum of distances and diameter only depend on the
+//parent's distance matrix D and S. D is kept as zero padded uint8 rows,
+//which the kernel walks with AVX2 or SSE2 when they're available.
+
+#define SCORE_ALIGN 32
+
+typedef struct {
+	unsigned n; //number of vertices in the parent
+	unsigned stride; //row length in bytes, a multiple of SCORE_ALIGN
+	uint8_t *rows; //n rows, followed by one row for d(v, .)
+	uint8_t *dv; //points to the last row
+} score_batch;
+
+bool score_batch_init(score_batch *batch, int *distances, unsigned n,
+					  unsigned distances_stride);
+void score_batch_fini(score_batch *batch);
+void score_child(score_batch *batch, unsigned *neighbours, unsigned size,
+				 int *sum_of_distances, int *diameter);
+void score_child_distances(score_batch *batch, int *distances,
+						   unsigned distances_stride);
+
+#endif
@@ -0,0 +1,493 @@
+#define _DEFAULT_SOURCE
+#include "shard.h"
+#include "ring.h"
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+//A child on its way to its owner, followed by its canonical form.
+//m == 0 marks the end of a level.
+typedef struct {
+	unsigned m;
+	unsigned sum_of_distances, diameter;
+	unsigned long fingerprint, fingerprint_hi;
+	setword gcan[];
+} shard_record;
+
+//Single producer, single consumer, like spsc_ring but with the records
+//inline (followed by SHARD_RING_SIZE records), since pointers into
+//either process's heap mean nothing to the other
+typedef struct {
+	unsigned long head;
+	char pad0[RING_CACHE_LINE];
+	unsigned long tail;
+	char pad1[RING_CACHE_LINE];
+} shard_ring;
+
+//Sort key of a graph in a shard's bucket. Graphs with the same
+//fingerprint are in the same shard, so it orders graphs of different
+//shards the same way as graph_info_compare().
+typedef struct {
+	unsigned long score, fingerprint;
+} shard_key;
+
+//Start of the shared memory
+typedef struct {
+	pthread_barrier_t barrier;
+	//sums over all shards for the current level
+	unsigned long skipped, canonicalized, sent, checksum;
+} shard_header;
+
+//This process's view of the shared memory
+typedef struct {
+	unsigned self, num_shards;
+	unsigned p, max_num_m;
+	size_t record_size, ring_size;
+	
+	void *memory;
+	size_t memory_size;
+	shard_header *header;
+	unsigned long **thresholds; //[shard][i]
+	shard_key *keys; //[shard][i][p], best first
+	unsigned *num_keys; //[shard][i]
+	char *rings; //[from][to]
+	char *results; //best graph of each shard
+	
+	level *new;
+	unsigned ends; //end markers received on this level
+	unsigned long sent;
+} shard;
+
+static size_t align(size_t size)
+{
+	return (size + RING_CACHE_LINE - 1) / RING_CACHE_LINE * RING_CACHE_LINE;
+}
+
+static bool shard_init(shard *sh, unsigned max_n, unsigned p,
+					   unsigned num_shards)
+{
+	sh->num_shards = num_shards;
+	sh->p = p;
+	sh->max_num_m = max_n * MAX_K / 2 - (max_n - 1) + 1;
+	int m = (max_n + WORDSIZE - 1) / WORDSIZE;
+	sh->record_size = align(sizeof(shard_record) + max_n * m * sizeof(setword));
+	sh->ring_size = sizeof(shard_ring) + SHARD_RING_SIZE * sh->record_size;
+	
+	size_t thresholds_size = align(num_shards * sh->max_num_m *
+								   sizeof(unsigned long));
+	size_t keys_size = align(num_shards * sh->max_num_m * (size_t) p *
+							 sizeof(shard_key));
+	size_t num_keys_size = align(num_shards * sh->max_num_m *
+								 sizeof(unsigned));
+	size_t rings_size = num_shards * num_shards * sh->ring_size;
+	sh->memory_size = align(sizeof(shard_header)) + thresholds_size +
+					  keys_size + num_keys_size + rings_size +
+					  num_shards * sh->record_size;
+	//anonymous and shared, so it's at the same address after fork()
+	sh->memory = mmap(NULL, sh->memory_size, PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(sh->memory == MAP_FAILED)
+	{
+		perror("shard memory");
+		return false;
+	}
+	
+	char *next = sh->memory;
+	sh->header = (shard_header*) next;
+	next += align(sizeof(shard_header));
+	sh->thresholds = malloc(num_shards * sizeof(unsigned long*));
+	for(unsigned s = 0; s < num_shards; s++)
+		sh->thresholds[s] = (unsigned long*) next + s * sh->max_num_m;
+	next += thresholds_size;
+	sh->keys = (shard_key*) next;
+	next += keys_size;
+	sh->num_keys = (unsigned*) next;
+	next += num_keys_size;
+	sh->rings = next;
+	next += rings_size;
+	sh->results = next;
+	
+	pthread_barrierattr_t attr;
+	pthread_barrierattr_init(&attr);
+	pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_barrier_init(&sh->header->barrier, &attr, num_shards);
+	pthread_barrierattr_destroy(&attr);
+	sh->ends = 0;
+	return true;
+}
+
+static void shard_fini(shard *sh)
+{
+	pthread_barrier_destroy(&sh->header->barrier);
+	munmap(sh->memory, sh->memory_size);
+	free(sh->thresholds);
+}
+
+static void shard_wait(shard *sh)
+{
+	pthread_barrier_wait(&sh->header->barrier);
+}
+
+static shard_ring *ring_between(shard *sh, unsigned from, unsigned to)
+{
+	return (shard_ring*) (sh->rings +
+						  (from * sh->num_shards + to) * sh->ring_size);
+}
+
+static shard_record *ring_record(shard *sh, shard_ring *ring,
+								 unsigned long index)
+{
+	return (shard_record*) ((char*) (ring + 1) +
+							(index % SHARD_RING_SIZE) * sh->record_size);
+}
+
+//g == NULL writes an end marker
+static void write_record(shard_record *r, graph_info *g)
+{
+	if(!g)
+	{
+		r->m = 0;
+		return;
+	}
+	int m = (g->n + WORDSIZE - 1) / WORDSIZE;
+	r->m = g->m;
+	r->sum_of_distances = g->sum_of_distances;
+	r->diameter = g->diameter;
+	r->fingerprint = g->fingerprint;
+	r->fingerprint_hi = g->fingerprint_hi;
+	memcpy(r->gcan, g->gcan, g->n * m * sizeof(setword));
+}
+
+//Returns a graph_info with only the score and canonical form filled
+//in (see graph_info_expand())
+static graph_info *read_record(shard_record *r, unsigned n)
+{
+	int m = (n + WORDSIZE - 1) / WORDSIZE;
+	graph_info *g = malloc(sizeof(graph_info));
+	g->n = n;
+	g->m = r->m;
+	g->sum_of_distances = r->sum_of_distances;
+	g->diameter = r->diameter;
+	g->fingerprint = r->fingerprint;
+	g->fingerprint_hi = r->fingerprint_hi;
+	g->distances = NULL;
+	g->k = NULL;
+	g->adj = NULL;
+	g->max_k = 0;
+	g->nauty_graph = NULL;
+	g->parent = NULL;
+	g->frozen_adj = NULL;
+	g->new_degree = 0;
+	g->cache_key = g->cache_key_hi = 0;
+	g->gcan = malloc(n * m * sizeof(setword));
+	memcpy(g->gcan, r->gcan, n * m * sizeof(setword));
+	return g;
+}
+
+//Adds everything the other shards have sent so far to the new level
+static void receive_all(shard *sh)
+{
+	for(unsigned from = 0; from < sh->num_shards; from++)
+	{
+		if(from == sh->self)
+			continue;
+		shard_ring *ring = ring_between(sh, from, sh->self);
+		unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+		unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		for(; head != tail; head++)
+		{
+			shard_record *r = ring_record(sh, ring, head);
+			if(r->m == 0)
+				sh->ends++;
+			else
+			{
+				graph_info *g = read_record(r, sh->new->n);
+				if(!add_graph_to_level(g, sh->new))
+					graph_info_destroy(g);
+			}
+		}
+		__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+	}
+}
+
+//Keeps receiving while the ring to the other shard is full, so that
+//two shards sending to each other can't both wait forever
+static void send(shard *sh, unsigned to, graph_info *g)
+{
+	shard_ring *ring = ring_between(sh, sh->self, to);
+	unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	while(tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >=
+		  SHARD_RING_SIZE)
+	{
+		receive_all(sh);
+		sched_yield();
+	}
+	write_record(ring_record(sh, ring, tail), g);
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void shard_offer(graph_info *child, void *data)
+{
+	shard *sh = data;
+	if(sh->new->canonical_augmentation && !is_canonical_child(child))
+	{
+		graph_info_destroy(child);
+		return;
+	}
+	calc_gcan(child);
+	
+	unsigned owner = child->fingerprint % sh->num_shards;
+	if(owner == sh->self)
+	{
+		if(!add_graph_to_level(child, sh->new))
+			graph_info_destroy(child);
+		return;
+	}
+	send(sh, owner, child);
+	sh->sent++;
+	graph_info_destroy(child);
+}
+
+//Like level_extend(), for the parents of old this shard owns (which
+//are all of them, except in the first level).
+//Returns the number of parents that were skipped.
+static unsigned long extend_own(shard *sh, level *old)
+{
+	unsigned max_diameter[old->num_m];
+	parent_ref *parents;
+	unsigned num_parents = level_sorted_parents(old, &parents, max_diameter);
+	bool done[old->num_m];
+	for(unsigned i = 0; i < old->num_m; i++)
+		done[i] = false;
+	
+	unsigned long skipped = 0;
+	for(unsigned j = 0; j < num_parents; j++)
+	{
+		graph_info *g = parents[j].graph;
+		unsigned i = parents[j].i;
+		if(g->fingerprint % sh->num_shards != sh->self)
+			continue;
+		if(!done[i])
+			done[i] = level_children_rejected(old, i, g->sum_of_distances,
+											  max_diameter[i], sh->new);
+		if(done[i])
+		{
+			skipped++;
+			continue;
+		}
+		
+		bool compact = !g->distances;
+		if(compact)
+			graph_info_expand(g);
+		extend_graph(g, sh->new, shard_offer, sh);
+		if(compact)
+			graph_info_compact(g);
+		receive_all(sh);
+	}
+	free(parents);
+	
+	for(unsigned to = 0; to < sh->num_shards; to++)
+		if(to != sh->self)
+			send(sh, to, NULL);
+	while(sh->ends < sh->num_shards - 1)
+	{
+		receive_all(sh);
+		sched_yield();
+	}
+	sh->ends = 0;
+	return skipped;
+}
+
+typedef struct {
+	shard_key *keys;
+	unsigned num_keys;
+} keys_state;
+
+static bool keys_visit(graph_info *g, void *data)
+{
+	keys_state *state = data;
+	shard_key key = {graph_info_score(g), g->fingerprint};
+	state->keys[state->num_keys++] = key;
+	return true;
+}
+
+static bool shard_key_less(shard_key k1, shard_key k2)
+{
+	return k1.score != k2.score ? k1.score < k2.score
+								: k1.fingerprint < k2.fingerprint;
+}
+
+//Trims each bucket of the new level to the graphs that are among the
+//best p of all shards, by a k-way merge of every shard's sorted keys
+static void merge_buckets(shard *sh)
+{
+	level *new = sh->new;
+	unsigned stride = sh->max_num_m * sh->p;
+	for(unsigned i = 0; i < new->num_m; i++)
+	{
+		keys_state state = {sh->keys + sh->self * stride + i * sh->p, 0};
+		level_foreach(new, i, keys_visit, &state);
+		sh->num_keys[sh->self * sh->max_num_m + i] = state.num_keys;
+	}
+	shard_wait(sh);
+	
+	for(unsigned i = 0; i < new->num_m; i++)
+	{
+		unsigned pos[sh->num_shards];
+		for(unsigned s = 0; s < sh->num_shards; s++)
+			pos[s] = 0;
+		unsigned keep = 0;
+		for(unsigned j = 0; j < sh->p; j++)
+		{
+			shard_key *best = NULL;
+			unsigned best_shard = 0;
+			for(unsigned s = 0; s < sh->num_shards; s++)
+			{
+				if(pos[s] == sh->num_keys[s * sh->max_num_m + i])
+					continue;
+				shard_key *key = &sh->keys[s * stride + i * sh->p + pos[s]];
+				if(!best || shard_key_less(*key, *best))
+				{
+					best = key;
+					best_shard = s;
+				}
+			}
+			if(!best)
+				break;
+			pos[best_shard]++;
+			if(best_shard == sh->self)
+				keep++;
+		}
+		level_truncate(new, i, keep);
+	}
+}
+
+static bool best_visit(graph_info *g, void *data)
+{
+	graph_info **best_graph = data;
+	if(*best_graph == NULL || graph_info_compare(g, *best_graph) < 0)
+		*best_graph = g;
+	//graphs are visited best first
+	return false;
+}
+
+//Extends first up to max_n vertices with num_shards processes, and
+//returns the best graph of the last level (expanded), or NULL if the
+//shared memory or the processes couldn't be set up. Only returns in
+//the calling process, and takes over first.
+graph_info *shard_search(level *first, unsigned max_n, unsigned p,
+						 unsigned num_shards, level_factory new_level)
+{
+	shard sh;
+	if(!shard_init(&sh, max_n, p, num_shards))
+		return NULL;
+	
+	//children would print whatever is still buffered again
+	fflush(stdout);
+	pid_t pids[num_shards];
+	sh.self = 0;
+	for(unsigned s = 1; s < num_shards; s++)
+	{
+		pids[s] = fork();
+		if(pids[s] == 0)
+		{
+			sh.self = s;
+			break;
+		}
+		if(pids[s] < 0)
+		{
+			//the others would wait at the barrier forever
+			perror("fork");
+			for(unsigned t = 1; t < s; t++)
+			{
+				kill(pids[t], SIGKILL);
+				waitpid(pids[t], NULL, 0);
+			}
+			shard_fini(&sh);
+			return NULL;
+		}
+	}
+	
+	level *cur_level = first;
+	for(unsigned n = first->n; n < max_n; n++)
+	{
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		unsigned long canon_calls = canon_num_calls();
+		sh.new = new_level(n + 1);
+		level_share_thresholds(sh.new, sh.thresholds, num_shards, sh.self);
+		sh.sent = 0;
+		//every shard's thresholds are reset
+		shard_wait(&sh);
+		
+		unsigned long skipped = extend_own(&sh, cur_level);
+		level_delete(cur_level);
+		cur_level = sh.new;
+		merge_buckets(&sh);
+		
+		__atomic_fetch_add(&sh.header->skipped, skipped, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&sh.header->canonicalized,
+						   canon_num_calls() - canon_calls, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&sh.header->sent, sh.sent, __ATOMIC_RELAXED);
+		//checksums add up over disjoint parts of a level
+		__atomic_fetch_add(&sh.header->checksum, level_checksum(cur_level),
+						   __ATOMIC_RELAXED);
+		shard_wait(&sh);
+		
+		//the others don't touch the header again until the next wait
+		if(sh.self == 0)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			printf("n = %u: %.3fs, %lu parents skipped, %lu canonicalized\n",
+				   n + 1, (end.tv_sec - start.tv_sec) +
+				   (end.tv_nsec - start.tv_nsec) / 1e9, sh.header->skipped,
+				   sh.header->canonicalized);
+			printf("  %lu children sent between %u shards\n",
+				   sh.header->sent, num_shards);
+			printf("checksum: %016lx\n", sh.header->checksum);
+			fflush(stdout);
+			sh.header->skipped = sh.header->canonicalized = 0;
+			sh.header->sent = sh.header->checksum = 0;
+		}
+	}
+	
+	graph_info *best_graph = NULL;
+	for(int i = 0; i < cur_level->num_m; i++)
+		level_foreach(cur_level, i, best_visit, &best_graph);
+	write_record((shard_record*) (sh.results + sh.self * sh.record_size),
+				 best_graph);
+	unsigned n = cur_level->n;
+	level_delete(cur_level);
+	shard_wait(&sh);
+	if(sh.self != 0)
+		_exit(0);
+	
+	for(unsigned s = 1; s < num_shards; s++)
+		waitpid(pids[s], NULL, 0);
+	best_graph = NULL;
+	for(unsigned s = 0; s < num_shards; s++)
+	{
+		shard_record *r = (shard_record*) (sh.results + s * sh.record_size);
+		if(r->m == 0)
+			continue;
+		graph_info *g = read_record(r, n);
+		if(best_graph == NULL || graph_info_compare(g, best_graph) < 0)
+		{
+			if(best_graph)
+				graph_info_destroy(best_graph);
+			best_graph = g;
+		}
+		else
+			graph_info_destroy(g);
+	}
+	shard_fini(&sh);
+	if(best_graph)
+		graph_info_expand(best_graph);
+	return best_graph;
+}
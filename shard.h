@@ -0,0 +1,29 @@
+#ifndef __SHARD_H__
+#define __SHARD_H__
+
+#include "level.h"
+
+//The search split across processes on one host.
+//Each of num_shards processes (forked from the caller) owns the graphs
+//whose fingerprint is its index mod num_shards. It extends only its own
+//parents, canonicalizes their children itself, and hands each child to
+//its owner over a shared-memory ring (one for each pair of shards).
+//Once every shard has all of its children, a k-way merge of the shards'
+//sorted buckets trims each of them to its share of the best p graphs of
+//each m, so every level is the same as level_extend()'s.
+//Every process has its own copy of nauty's and geng's globals, so
+//they don't need to be reentrant. The shards' thresholds are in shared
+//memory too, and a score is rejected if any of them rejects it: a shard
+//with a full bucket has p graphs that beat it.
+//Doesn't support spilling, the metrics cache or the pipeline.
+
+//Slots in each ring
+#define SHARD_RING_SIZE 64
+
+//Creates an empty level with n vertices, set up like the others
+typedef level *(*level_factory)(unsigned n);
+
+graph_info *shard_search(level *first, unsigned max_n, unsigned p,
+						 unsigned num_shards, level_factory new_level);
+
+#endif
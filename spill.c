@@ -0,0 +1,273 @@
+#define _POSIX_C_SOURCE 200809L
+#include "spill.h"
+#include "priority_queue.h"
+#include "gtools.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+//Creates an empty temporary file in dir
+static FILE *open_temp(const char *dir, char **path)
+{
+	*path = malloc(strlen(dir) + sizeof("/fwg_spill_XXXXXX"));
+	sprintf(*path, "%s/fwg_spill_XXXXXX", dir);
+	int fd = mkstemp(*path);
+	FILE *file = fd < 0 ? NULL : fdopen(fd, "w+");
+	if(!file)
+	{
+		perror(*path);
+		free(*path);
+		*path = NULL;
+	}
+	return file;
+}
+
+spill *spill_create(const char *dir, unsigned n, unsigned p)
+{
+	spill *s = malloc(sizeof(spill));
+	if(!s)
+		return NULL;
+	s->file = open_temp(dir, &s->path);
+	if(!s->file)
+	{
+		free(s);
+		return NULL;
+	}
+	s->dir = strdup(dir);
+	s->n = n;
+	s->p = p;
+	s->num_runs = 0;
+	s->run_starts = malloc(SPILL_FAN_IN * sizeof(long));
+	s->has_cutoff = false;
+	return s;
+}
+
+void spill_delete(spill *s)
+{
+	fclose(s->file);
+	unlink(s->path);
+	free(s->path);
+	free(s->dir);
+	free(s->run_starts);
+	free(s);
+}
+
+//Record format: "sum diameter m graph6\n", where the graph6 string is
+//the canonical form of the graph
+
+static void write_record(FILE *file, graph_info *g)
+{
+	int m = (g->n + WORDSIZE - 1) / WORDSIZE;
+	fprintf(file, "%d %d %d %s", g->sum_of_distances, g->diameter, g->m,
+			ntog6(g->gcan, m, g->n));
+}
+
+//Returns a graph_info with only the score and canonical form filled
+//in (see graph_info_expand()), or NULL at the
+//end of the run
+static graph_info *read_record(FILE *file, long end, char *buf, int buf_len,
+							   unsigned n)
+{
+	if(ftell(file) >= end)
+		return NULL;
+	
+	graph_info *g = malloc(sizeof(graph_info));
+	if(fscanf(file, "%d %d %d ", &g->sum_of_distances, &g->diameter,
+			  &g->m) != 3 || !fgets(buf, buf_len, file))
+	{
+		free(g);
+		return NULL;
+	}
+	
+	int m = (n + WORDSIZE - 1) / WORDSIZE;
+	g->n = n;
+	g->distances = NULL;
+	g->k = NULL;
+	g->adj = NULL;
+	g->max_k = 0;
+	g->nauty_graph = NULL;
+	g->parent = NULL;
+	g->frozen_adj = NULL;
+	g->new_degree = 0;
+	g->cache_key = g->cache_key_hi = 0;
+	g->gcan = malloc(n * m * sizeof(setword));
+	stringtograph(buf, g->gcan, m);
+	calc_fingerprint(g);
+	return g;
+}
+
+//Merge cursors, either over a run on disk or the (sorted) hot graphs
+
+typedef struct {
+	FILE *file;
+	long end;
+	graph_info **hot;
+	unsigned num_hot;
+	graph_info *cur;
+} cursor;
+
+static bool cursor_next(cursor *c, char *buf, int buf_len, unsigned n)
+{
+	if(c->file)
+		c->cur = read_record(c->file, c->end, buf, buf_len, n);
+	else
+		c->cur = c->num_hot ? (c->num_hot--, *c->hot++) : NULL;
+	return c->cur != NULL;
+}
+
+//The queue pulls its "greatest" element, we want the best graph
+static bool cursor_compare_gt(void *elem1, void *elem2)
+{
+	cursor *c1 = elem1, *c2 = elem2;
+	return graph_info_compare(c1->cur, c2->cur) < 0;
+}
+
+static void cursor_delete(void *elem)
+{
+}
+
+//Visits the best (at most p) distinct graphs in the runs and the hot
+//graphs, best first, until func returns false.
+//Graphs read from disk only have their score and adjacency filled in,
+//and are freed after func returns.
+void spill_merge(spill *s, graph_info **hot, unsigned num_hot,
+				 graph_visit_func func, void *data)
+{
+	int buf_len = G6LEN(s->n) + 3;
+	char buf[buf_len];
+	int m = (s->n + WORDSIZE - 1) / WORDSIZE;
+	
+	fflush(s->file);
+	fseek(s->file, 0, SEEK_END);
+	long file_end = ftell(s->file);
+	
+	cursor cursors[s->num_runs + 1];
+	priority_queue *queue = priority_queue_create(cursor_compare_gt,
+												  cursor_delete);
+	priority_queue_reserve(queue, s->num_runs + 1);
+	for(unsigned i = 0; i < s->num_runs; i++)
+	{
+		cursors[i].file = fopen(s->path, "r");
+		if(!cursors[i].file)
+		{
+			perror(s->path);
+			exit(1);
+		}
+		fseek(cursors[i].file, s->run_starts[i], SEEK_SET);
+		cursors[i].end = i + 1 < s->num_runs ? s->run_starts[i + 1] : file_end;
+		if(cursor_next(&cursors[i], buf, buf_len, s->n))
+			priority_queue_push(queue, &cursors[i]);
+	}
+	cursors[s->num_runs].file = NULL;
+	cursors[s->num_runs].hot = hot;
+	cursors[s->num_runs].num_hot = num_hot;
+	if(cursor_next(&cursors[s->num_runs], buf, buf_len, s->n))
+		priority_queue_push(queue, &cursors[s->num_runs]);
+	
+	//the last graph visited, to skip duplicates (which are adjacent
+	//since graph_info_compare() is a total order)
+	graph_info prev;
+	setword prev_gcan[s->n * m];
+	prev.n = 0;
+	prev.gcan = prev_gcan;
+	
+	unsigned visited = 0;
+	bool done = false;
+	while(priority_queue_num_elems(queue))
+	{
+		cursor *c = priority_queue_pull(queue);
+		graph_info *g = c->cur;
+		if(!done && visited < s->p &&
+		   (prev.n == 0 || graph_info_compare(&prev, g) != 0))
+		{
+			prev.n = g->n;
+			prev.sum_of_distances = g->sum_of_distances;
+			prev.diameter = g->diameter;
+			prev.fingerprint = g->fingerprint;
+			prev.fingerprint_hi = g->fingerprint_hi;
+			memcpy(prev_gcan, g->gcan, s->n * m * sizeof(setword));
+			visited++;
+			done = !func(g, data);
+		}
+		if(c->file)
+			graph_info_destroy(g);
+		
+		if(done || visited >= s->p)
+			continue; //just drain the queue
+		if(cursor_next(c, buf, buf_len, s->n))
+			priority_queue_push(queue, c);
+	}
+	
+	priority_queue_delete(queue);
+	for(unsigned i = 0; i < s->num_runs; i++)
+		fclose(cursors[i].file);
+}
+
+typedef struct {
+	FILE *file;
+	unsigned count;
+	unsigned long last_score;
+} write_state;
+
+static bool write_visit(graph_info *g, void *data)
+{
+	write_state *state = data;
+	write_record(state->file, g);
+	state->count++;
+	state->last_score = graph_info_score(g);
+	return true;
+}
+
+//Merges all the runs into a single run of at most p graphs
+static bool compact(spill *s)
+{
+	write_state state;
+	char *path;
+	state.file = open_temp(s->dir, &path);
+	if(!state.file)
+		return false;
+	state.count = 0;
+	
+	spill_merge(s, NULL, 0, write_visit, &state);
+	
+	//the run is full, so nothing worse than its last graph can get in
+	//to the best p anymore
+	if(state.count >= s->p)
+	{
+		s->has_cutoff = true;
+		s->cutoff = state.last_score;
+	}
+	
+	fclose(s->file);
+	unlink(s->path);
+	free(s->path);
+	s->path = path;
+	s->file = state.file;
+	s->num_runs = 1;
+	s->run_starts[0] = 0;
+	return true;
+}
+
+//Writes num_graphs graphs, sorted best first, as a new run
+bool spill_write_run(spill *s, graph_info **sorted, unsigned num_graphs)
+{
+	if(s->num_runs == SPILL_FAN_IN && !compact(s))
+		return false;
+	
+	fseek(s->file, 0, SEEK_END);
+	s->run_starts[s->num_runs++] = ftell(s->file);
+	for(unsigned i = 0; i < num_graphs; i++)
+	{
+		if(spill_rejects(s, graph_info_score(sorted[i])))
+			break;
+		write_record(s->file, sorted[i]);
+	}
+	return !ferror(s->file);
+}
+
+//True if a graph with this score can't be one of the best p graphs of
+//this bucket anymore
+bool spill_rejects(spill *s, unsigned long score)
+{
+	return s->has_cutoff && score > s->cutoff;
+}
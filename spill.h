@@ -0,0 +1,37 @@
+#ifndef __SPILL_H__
+#define __SPILL_H__
+
+#include "graph.h"
+#include <stdio.h>
+
+//External memory part of a beam bucket.
+//Graphs that don't fit in memory are written out as sorted runs of
+//graph6 strings (plus their score), and merged back together when the
+//bucket is read. When there are too many runs they're merged into one,
+//keeping only the best p graphs, which gives a cutoff that new graphs
+//can be checked against before they're even canonicalized.
+
+//Number of runs before they get merged together
+#define SPILL_FAN_IN 16
+
+typedef struct {
+	char *dir;
+	char *path;
+	FILE *file;
+	unsigned n;
+	unsigned p;
+	unsigned num_runs;
+	long *run_starts; //run i is [run_starts[i], run_starts[i+1]) (or EOF)
+	
+	bool has_cutoff;
+	unsigned long cutoff; //see graph_info_score()
+} spill;
+
+spill *spill_create(const char *dir, unsigned n, unsigned p);
+void spill_delete(spill *s);
+bool spill_write_run(spill *s, graph_info **sorted, unsigned num_graphs);
+bool spill_rejects(spill *s, unsigned long score);
+void spill_merge(spill *s, graph_info **hot, unsigned num_hot,
+				 graph_visit_func func, void *data);
+
+#endif